@@ -0,0 +1,277 @@
+/*
+ * bench.c - measures the chat over loopback, lines a second each way
+ * 	   - starts a server and a client, feeds -n numbered lines into the stdin of both
+ * 	     and counts those that come out of the other one
+ * 	   - the binaries are arguments, so an older build can be measured the same way,
+ * 	     e.g. ./bench -S old/server -C old/client, then ./bench for the current one
+ * 	   - gcc -O2 -o bench bench.c, next to server and client built from server.c and client.c
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+// constants for pipe FDs
+#define WFD 1
+#define RFD 0
+
+// defaults for -n, -b, -p, -w, -d
+#define LINES 100000
+#define LINE_BYTES 64
+#define PORT "40500"
+#define WAIT_MS 300
+#define SECONDS 30
+
+// the lines fed in start with it, everything else the programs print is ignored
+#define TAG "bench "
+
+// bytes read from a program's stdout at once
+#define READ_BUF 65536
+
+// one program, what goes into its stdin and what comes out of its stdout
+struct side {
+	const char* name;
+	pid_t pid;
+	int in, out;
+	// lines written and the bytes of the one being written, lines read
+	int sent, off, got;
+	// a line read in part, carried to the next read
+	int partial, tagged;
+	// ns the last line counted was read
+	long long last;
+};
+
+void error_exit(const char* error) {
+	perror(error);
+	exit(-1);
+}
+
+void usage(const char* prog) {
+	fprintf(stderr, "usage: %s [-S server] [-C client] [-p port] [-n lines] [-b bytes] [-w ms] [-d seconds]\n", prog);
+	fprintf(stderr, "	-S path - the server to run (default ./server)\n");
+	fprintf(stderr, "	-C path - the client to run (default ./client)\n");
+	fprintf(stderr, "	-p # - port they chat on (default %s)\n", PORT);
+	fprintf(stderr, "	-n # - lines fed into each of them (default %d)\n", LINES);
+	fprintf(stderr, "	-b # - bytes of a line, newline included (default %d)\n", LINE_BYTES);
+	fprintf(stderr, "	-w ms - wait for the server to listen before starting the client (default %d)\n", WAIT_MS);
+	fprintf(stderr, "	-d # - give up after this many seconds (default %d)\n", SECONDS);
+	exit(-1);
+}
+
+long long now_ns(void);
+void side_start(struct side* s, char* const argv[]);
+void side_write(struct side* s, const char* lines, int n, int len);
+int side_read(struct side* s, long long now);
+
+int main(int argc, char** argv) {
+
+	// getopt()
+	int opt, n = LINES, len = LINE_BYTES, wait_ms = WAIT_MS, seconds = SECONDS;
+	char *server = "./server", *client = "./client", *port = PORT;
+	while ((opt = getopt(argc, argv, "S:C:p:n:b:w:d:")) != -1) {
+		switch(opt){
+			case 'S':
+				server = optarg;
+				break;
+			case 'C':
+				client = optarg;
+				break;
+			case 'p':
+				port = optarg;
+				break;
+			case 'n':
+				n = atoi(optarg);
+				break;
+			case 'b':
+				len = atoi(optarg);
+				break;
+			case 'w':
+				wait_ms = atoi(optarg);
+				break;
+			case 'd':
+				seconds = atoi(optarg);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	// the tag, 8 digits and the newline
+	if ((n <= 0) || (n > 99999999) || (len < (int) sizeof(TAG) + 9) || (len > READ_BUF))
+		usage(argv[0]);
+
+	// every line the same length, its number after the tag, padded with x
+	char* lines = malloc((size_t) n * len);
+	if (lines == NULL)
+		error_exit("malloc");
+	for (int i = 0; i < n; i++) {
+		char* l = lines + (size_t) i * len;
+		int k = snprintf(l, len, TAG "%08d ", i);
+		memset(l + k, 'x', len - k - 1);
+		l[len - 1] = '\n';
+	}
+
+	// a program that hangs up is a count below n, not a signal
+	signal(SIGPIPE, SIG_IGN);
+
+	struct side srv = { .name = "server" }, cli = { .name = "client" };
+	char* srv_argv[] = { server, "-p", port, NULL };
+	char* cli_argv[] = { client, "-s", "127.0.0.1", "-p", port, NULL };
+	side_start(&srv, srv_argv);
+	struct timespec ts = { wait_ms / 1000, (wait_ms % 1000) * 1000000L };
+	nanosleep(&ts, NULL);
+	side_start(&cli, cli_argv);
+
+	// until each has seen all the other's lines, or both stopped printing
+	long long start = now_ns(), end = start + (long long) seconds * 1000000000;
+	int srv_open = 1, cli_open = 1;
+	while ((srv_open || cli_open) && ((srv.got < n) || (cli.got < n))) {
+		struct pollfd pfds[4] = {
+			{ (srv.sent < n) ? srv.in : -1, POLLOUT, 0 },
+			{ (cli.sent < n) ? cli.in : -1, POLLOUT, 0 },
+			{ srv_open ? srv.out : -1, POLLIN, 0 },
+			{ cli_open ? cli.out : -1, POLLIN, 0 },
+		};
+		long long now = now_ns();
+		if (now >= end)
+			break;
+		if (poll(pfds, 4, (end - now) / 1000000 + 1) == -1) {
+			if (errno == EINTR)
+				continue;
+			error_exit("poll bench");
+		}
+
+		if (pfds[0].revents)
+			side_write(&srv, lines, n, len);
+		if (pfds[1].revents)
+			side_write(&cli, lines, n, len);
+		now = now_ns();
+		if (pfds[2].revents)
+			srv_open = side_read(&srv, now);
+		if (pfds[3].revents)
+			cli_open = side_read(&cli, now);
+	}
+
+	// what the server showed was typed into the client, and the other way around
+	struct side* dir[2][2] = { { &cli, &srv }, { &srv, &cli } };
+	for (int d = 0; d < 2; d++) {
+		struct side *from = dir[d][0], *to = dir[d][1];
+		double secs = ((to->got > 0) ? to->last - start : now_ns() - start) / 1e9;
+		printf("%s -> %s: %d of %d lines in %.1f ms, %.0f lines/s\n", from->name, to->name,
+				to->got, n, secs * 1000, (secs > 0) ? to->got / secs : 0.0);
+	}
+
+	kill(cli.pid, SIGTERM);
+	kill(srv.pid, SIGTERM);
+	waitpid(cli.pid, NULL, 0);
+	waitpid(srv.pid, NULL, 0);
+	free(lines);
+	return 0;
+}
+
+long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * side_start - run a program with its stdin and stdout on pipes to us
+ * @param s - the side, its pipes set, nonblocking
+ * @param argv - the program and its arguments
+ */
+void side_start(struct side* s, char* const argv[]) {
+	int inFDs[2], outFDs[2];
+
+	if ((pipe(inFDs) == -1) || (pipe(outFDs) == -1))
+		error_exit("pipe");
+	pid_t pid = fork();
+	if (pid < 0) error_exit("fork");
+	else if (pid == 0) {
+		// child
+		dup2(inFDs[RFD], STDIN_FILENO);
+		dup2(outFDs[WFD], STDOUT_FILENO);
+		close(inFDs[RFD]);
+		close(inFDs[WFD]);
+		close(outFDs[RFD]);
+		close(outFDs[WFD]);
+		execv(argv[0], argv);
+		error_exit(argv[0]);
+	}
+	// parent
+	close(inFDs[RFD]);
+	close(outFDs[WFD]);
+	s->pid = pid;
+	s->in = inFDs[WFD];
+	s->out = outFDs[RFD];
+	fcntl(s->in, F_SETFL, fcntl(s->in, F_GETFL) | O_NONBLOCK);
+	fcntl(s->out, F_SETFL, fcntl(s->out, F_GETFL) | O_NONBLOCK);
+}
+
+/*
+ * side_write - feed a program as many of its lines as its stdin takes, EOF after the last
+ * @param s - the side
+ * @param lines - n lines of len bytes
+ * @param n - # of lines
+ * @param len - bytes of a line
+ */
+void side_write(struct side* s, const char* lines, int n, int len) {
+	while (s->sent < n) {
+		size_t at = (size_t) s->sent * len + s->off;
+		ssize_t w = write(s->in, lines + at, (size_t) n * len - at);
+		if (w == -1) {
+			if ((errno == EAGAIN) || (errno == EINTR))
+				return;
+			// it exited, the rest will not be counted
+			s->sent = n;
+			break;
+		}
+		s->sent += (s->off + w) / len;
+		s->off = (s->off + w) % len;
+	}
+	close(s->in);
+}
+
+/*
+ * side_read - count the tagged lines a program printed
+ * @param s - the side
+ * @param now - ns the read happened
+ * @returns 1 while it may print more, 0 at EOF
+ */
+int side_read(struct side* s, long long now) {
+	static char buf[READ_BUF];
+	ssize_t r;
+
+	while ((r = read(s->out, buf, sizeof(buf))) > 0) {
+		// a line is tagged if it starts with TAG, the start may be in an earlier read,
+		// NULs are skipped, the server prints one before the client's first line
+		for (ssize_t i = 0; i < r; i++) {
+			if (buf[i] == '\0')
+				continue;
+			if (s->partial < (int) sizeof(TAG) - 1) {
+				if (buf[i] == TAG[s->partial])
+					s->tagged = (++s->partial == sizeof(TAG) - 1);
+				else if (buf[i] != '\n')
+					s->partial = sizeof(TAG);
+			}
+			if (buf[i] == '\n') {
+				if (s->tagged) {
+					s->got++;
+					s->last = now;
+				}
+				s->partial = s->tagged = 0;
+			}
+		}
+	}
+	if ((r == -1) && ((errno == EAGAIN) || (errno == EINTR)))
+		return 1;
+	close(s->out);
+	return 0;
+}
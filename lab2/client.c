@@ -10,102 +10,249 @@
 #include <sys/socket.h>
 // AF_INET, sockaddr_in
 #include <netinet/in.h>
-// gethostbyaddr, gethostbyname
+// getaddrinfo()
 #include <netdb.h>
 // htons()
 #include <arpa/inet.h>
 // getopt()
 #include <unistd.h>
+// poll()
+#include <poll.h>
+// fcntl()
+#include <fcntl.h>
+// signal()
+#include <signal.h>
+// nanosleep()
+#include <time.h>
 
 void error_exit(const char* error) {
 	perror(error);
 	exit(-1);
 }
 
+// ms before reconnecting, drawn at random up to a bound
+// that doubles from BACKOFF_MIN to BACKOFF_MAX with every failed attempt
+#define BACKOFF_MIN 50
+#define BACKOFF_MAX 5000
+
+// reconnects failed since the server last sent anything
+int attempts;
+
+// bytes moved at once in one direction
+#define PUMP_BUF 65536
+
+// one direction of the chat, what was read from `from` and not written to `to` yet
+struct pump {
+	int from, to;
+	char buf[PUMP_BUF];
+	int len, off;
+	// from is at EOF, bytes read since the caller last looked, the fd that failed
+	int eof, got, failed;
+};
+
+void pump_poll(struct pump* p, struct pollfd* in, struct pollfd* out);
+int pump_run(struct pump* p, int ready);
+
+int server_connect(const char* host, const char* port);
+int reconnect(const char* host, const char* port, int socketFD);
+
 int main(int argc, char** argv) {
 
 	// getopt()
-	int opt, port;
-	while ((opt = getopt(argc, argv, "hp:")) != -1) {
+	int opt;
+	char *host = "localhost", *port = NULL;
+	while ((opt = getopt(argc, argv, "hs:p:")) != -1) {
 		switch(opt){
 			case 'p':
-				port = atoi(optarg);
+				port = optarg;
+				break;
+			case 's':
+				host = optarg;
 				break;
 			case 'h':
-				printf("usage: ./server [-h] [-p port#]\n");
+				printf("usage: ./client [-h] [-s host] [-p port#]\n");
 				printf("	-h - this help message\n");
+				printf("	-s host - name or address of the server (default localhost)\n");
 				printf("	-p # - the port to use when connecting to the server\n");
+				printf("	reconnects when the server goes away, lines it had not read by then are lost\n");
 				exit(0);
 		}
 	}
-
-	struct sockaddr_in serv_addr;
-	int socketFD;
-
-	memset(&serv_addr, 0, sizeof(serv_addr));
-
-	struct hostent* host = gethostbyname("senna");
-	serv_addr.sin_family = AF_INET;
-	// char ** -> in_addr_t
-	// inet_addr() takes char* IP address from dotted-decimal notation to
-	// 		to Big Edian, network byte order 32 bits
-	// inet_ntoa() takes in in_addr(hence casting struct in_addr*)
-	// 		returns char* IP address
-	// sin_addr.s_addr == struct in_addr of in_addr_t type IPv4 addresses
-	// h_addr_list == char**, list of addresses
-	serv_addr.sin_addr.s_addr = inet_addr(inet_ntoa(*(struct in_addr*)*host->h_addr_list));
-	serv_addr.sin_port = htons(port);
-
-	if ((socketFD = socket(AF_INET, SOCK_STREAM, 0)) == -1) error_exit("socket");
-
-	// connect
-	if(connect(socketFD, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
-		close(socketFD);
-		error_exit("connect");
+	if (port == NULL) {
+		fprintf(stderr, "-p is required\n");
+		exit(-1);
 	}
 
+	// connect, only reconnects are retried
+	int socketFD = server_connect(host, port);
+	if (socketFD == -1)
+		exit(-1);
+	srandom(getpid() ^ time(NULL));
+	// a server hanging up mid-write is an EPIPE, not a signal
+	signal(SIGPIPE, SIG_IGN);
+
 	write(STDOUT_FILENO, "connected to server...\n\n", sizeof("connected to server...\n\n"));
 
-	// chat
-	int rbyte, kbyte;
-	char rbuf[1024], kbuf[1024];
-	while(1) {
-		if (write(STDOUT_FILENO, "> ", 3) == -1)
-			error_exit("> write");
-
-		// read from the keyboard
-		kbyte = read(STDIN_FILENO, kbuf, sizeof(kbuf));
-		// EOF
-		if (kbyte == 0) {
-			close(socketFD);
-			write(STDOUT_FILENO, "hanging up\n", 12);
-			exit(0);
+	// chat, both ways at once
+	static struct pump out, in;
+	struct pollfd pfds[4];
+	int sending = 1, showing = 1;
+
+	// keyboard to server, server onto display
+	out.from = STDIN_FILENO;
+	out.to = socketFD;
+	in.from = socketFD;
+	in.to = STDOUT_FILENO;
+	fcntl(socketFD, F_SETFL, fcntl(socketFD, F_GETFL) | O_NONBLOCK);
+
+	// until EOF is typed and the server has hung up its side too
+	while (sending || showing) {
+		pump_poll(&out, &pfds[0], &pfds[1]);
+		pump_poll(&in, &pfds[2], &pfds[3]);
+		if (poll(pfds, 4, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			error_exit("poll client");
 		}
-		// error
-		if (kbyte < 0)
-			error_exit("keyboard error");
-
-		// write to the server
-		if (send(socketFD, kbuf, kbyte, 0) == -1)
-			error_exit("server write");
-
-		// read from the server
-		rbyte = recv(socketFD, rbuf, sizeof(rbuf), 0);
-		// EOF
-		if (rbyte == 0) {
-			close(socketFD);
-			write(STDOUT_FILENO, "hanging up\n", 12);
-			exit(0);
+
+		// EOF from the keyboard hangs up our side
+		if (sending && ((sending = pump_run(&out, pfds[0].revents != 0)) == 0))
+			shutdown(socketFD, SHUT_WR);
+		if (showing)
+			showing = pump_run(&in, pfds[2].revents != 0);
+		if (in.got) {
+			in.got = 0;
+			attempts = 0;
 		}
-		// error
-		if (rbyte < 0)
-			error_exit("server read");
+		if (((sending == -1) && (out.failed != socketFD)) || ((showing == -1) && (in.failed != socketFD)))
+			error_exit("keyboard or display");
 
-		// write onto display
-		if (write(STDOUT_FILENO, rbuf, rbyte) == -1)
-			error_exit("display write");
+		// the server went away while we were still sending, it only hangs up after us,
+		// so its EOF means it is gone too, what it had not read yet is lost with it,
+		// the rest goes to the next one
+		if ((sending == -1) || ((sending == 1) && (showing <= 0))) {
+			out.to = in.from = socketFD = reconnect(host, port, socketFD);
+			fcntl(socketFD, F_SETFL, fcntl(socketFD, F_GETFL) | O_NONBLOCK);
+			in.eof = 0;
+			sending = showing = 1;
+		}
+		// done sending, nothing more will come
+		else if (showing == -1)
+			showing = 0;
 	}
 
 	close(socketFD);
+	write(STDOUT_FILENO, "hanging up\n", 12);
 	return 0;
 }
+
+/*
+ * pump_poll - what a pump waits for, from while buf is empty, to while it is not
+ * @param p - the pump
+ * @param in - set to poll from
+ * @param out - set to poll to
+ */
+void pump_poll(struct pump* p, struct pollfd* in, struct pollfd* out) {
+	in->fd = ((p->len == 0) && !p->eof) ? p->from : -1;
+	in->events = POLLIN;
+	out->fd = (p->len > 0) ? p->to : -1;
+	out->events = POLLOUT;
+}
+
+/*
+ * pump_run - read from `from` if it is ready and buf is empty, write what buf holds
+ * 	    - neither end blocks the other direction, the socket is nonblocking
+ * @param p - the pump
+ * @param ready - from polled ready
+ * @returns 1 while more may come, 0 once from is at EOF and buf is written,
+ * 	    -1 on an error, p->failed set to the fd
+ */
+int pump_run(struct pump* p, int ready) {
+	int n;
+
+	if (ready && (p->len == 0) && !p->eof) {
+		if ((n = read(p->from, p->buf, sizeof(p->buf))) > 0) {
+			p->len = n;
+			p->off = 0;
+			p->got += n;
+		}
+		else if (n == 0)
+			p->eof = 1;
+		else if ((errno != EAGAIN) && (errno != EINTR)) {
+			p->failed = p->from;
+			return -1;
+		}
+	}
+	while (p->off < p->len) {
+		if ((n = write(p->to, p->buf + p->off, p->len - p->off)) == -1) {
+			if ((errno == EAGAIN) || (errno == EINTR))
+				break;
+			p->failed = p->to;
+			return -1;
+		}
+		p->off += n;
+	}
+	if (p->off == p->len)
+		p->len = p->off = 0;
+	return !(p->eof && (p->len == 0));
+}
+
+/*
+ * server_connect - connect to the server
+ * 		  - tries every address getaddrinfo() has for host, IPv6 and IPv4, in its order
+ * @param host - name or address of the server
+ * @param port - its port, or service name
+ * @returns the socket, -1 if no address took it, the reason is printed
+ */
+int server_connect(const char* host, const char* port) {
+	struct addrinfo hints, *ai, *a;
+	int fd = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	int err = getaddrinfo(host, port, &hints, &ai);
+	if (err != 0) {
+		fprintf(stderr, "%s: %s\n", host, gai_strerror(err));
+		return -1;
+	}
+	for (a = ai; a; a = a->ai_next) {
+		if ((fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol)) == -1)
+			continue;
+		if (connect(fd, a->ai_addr, a->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	if (fd == -1)
+		perror(host);
+	freeaddrinfo(ai);
+	return fd;
+}
+
+/*
+ * reconnect - connect again once the server went away
+ * 	     - waits a random time up to a bound that doubles with every failed attempt,
+ * 	       so clients of a restarting server do not all come back at once
+ * @param host - as for server_connect()
+ * @param port - as for server_connect()
+ * @param socketFD - the dead socket, closed
+ * @returns the new socket
+ */
+int reconnect(const char* host, const char* port, int socketFD) {
+	int fd = -1;
+
+	close(socketFD);
+	while (fd == -1) {
+		long bound = BACKOFF_MIN << ((attempts < 10) ? attempts : 10);
+		if (bound > BACKOFF_MAX)
+			bound = BACKOFF_MAX;
+		long ms = 1 + random() % bound;
+		attempts++;
+		fprintf(stderr, "reconnecting in %ld ms\n", ms);
+		struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+		nanosleep(&ts, NULL);
+		fd = server_connect(host, port);
+	}
+	return fd;
+}
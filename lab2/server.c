@@ -13,6 +13,8 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netdb.h>
+#include <poll.h>
+#include <signal.h>
 #include <arpa/inet.h>
 #include <sys/wait.h>
 
@@ -26,55 +28,117 @@ void error_exit(const char* error) {
 	exit(-1);
 }
 
+// bytes moved at once in one direction
+#define PUMP_BUF 65536
+
+// one direction of the chat, what was read from `from` and not written to `to` yet
+struct pump {
+	int from, to;
+	char buf[PUMP_BUF];
+	int len, off;
+	// from is at EOF
+	int eof;
+};
+
+/*
+ * pump_poll - what a pump waits for, from while buf is empty, to while it is not
+ * @param p - the pump
+ * @param in - set to poll from
+ * @param out - set to poll to
+ */
+void pump_poll(struct pump* p, struct pollfd* in, struct pollfd* out) {
+	in->fd = ((p->len == 0) && !p->eof) ? p->from : -1;
+	in->events = POLLIN;
+	out->fd = (p->len > 0) ? p->to : -1;
+	out->events = POLLOUT;
+}
+
+// end a pump on an error, errno is kept for the caller
+static int pump_stop(struct pump* p) {
+	p->eof = 1;
+	p->len = p->off = 0;
+	return -1;
+}
+
+/*
+ * pump_run - read from `from` if it is ready and buf is empty, write what buf holds
+ * 	    - neither end blocks the other direction, sockets and pipes are nonblocking
+ * @param p - the pump
+ * @param ready - from polled ready
+ * @returns 1 while more may come, 0 once from is at EOF and buf is written,
+ * 	    -1 on an error, p->from or p->to hung up, what buf held is dropped
+ * 	    and the pump polls nothing more
+ */
+int pump_run(struct pump* p, int ready) {
+	int n;
+
+	if (ready && (p->len == 0) && !p->eof) {
+		if ((n = read(p->from, p->buf, sizeof(p->buf))) > 0) {
+			p->len = n;
+			p->off = 0;
+		}
+		else if (n == 0)
+			p->eof = 1;
+		else if ((errno != EAGAIN) && (errno != EINTR))
+			return pump_stop(p);
+	}
+	while (p->off < p->len) {
+		if ((n = write(p->to, p->buf + p->off, p->len - p->off)) == -1) {
+			if ((errno == EAGAIN) || (errno == EINTR))
+				break;
+			return pump_stop(p);
+		}
+		p->off += n;
+	}
+	if (p->off == p->len)
+		p->len = p->off = 0;
+	return !(p->eof && (p->len == 0));
+}
+
 /*
  * monitor - provides a local chat window
+ * 	   - shows what the client sends while anything typed goes to it, both at once
  * @param srfd - server read file descriptor
  * @param swfd - server write file descriptor
  */
 void monitor(int srfd, int swfd) {
-
-  	int rbyte, kbyte;
-	char rbuf[1024], kbuf[1024];
-
-	while (1) {
-		// read from s2mFDs[RFD]
-		rbyte = read(srfd, rbuf, sizeof(rbuf));
-		// EOF
-		if (rbyte == 0) {
-			close(srfd);
-			close(swfd);
-			exit(0);
+	static struct pump show, type;
+	struct pollfd pfds[4];
+	int showing = 1, typing = 1;
+
+	show.from = srfd;
+	show.to = STDOUT_FILENO;
+	type.from = STDIN_FILENO;
+	type.to = swfd;
+	fcntl(srfd, F_SETFL, fcntl(srfd, F_GETFL) | O_NONBLOCK);
+	fcntl(swfd, F_SETFL, fcntl(swfd, F_GETFL) | O_NONBLOCK);
+
+	// until the client has hung up and EOF is typed
+	while (showing || typing) {
+		pump_poll(&show, &pfds[0], &pfds[1]);
+		pump_poll(&type, &pfds[2], &pfds[3]);
+		if (poll(pfds, 4, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			error_exit("poll monitor");
 		}
-		// error
-		if (rbyte < 0)
-			error_exit("s2m read");
 
-		// write onto display
-		if (write(STDOUT_FILENO, rbuf, rbyte) == -1)
+		// from s2mFDs[RFD] onto display
+		if (showing && ((showing = pump_run(&show, pfds[0].revents != 0)) == -1))
 			error_exit("display");
-		if (write(STDOUT_FILENO, "> ", 3) == -1)
-			error_exit("> write");
-
-		// read from keyboard
-		kbyte = read(STDIN_FILENO, kbuf, 1024);
-		// EOF
-		if (kbyte == 0) {
-			close(srfd);
+		// from the keyboard to m2sFDs[WFD], EOF closes it and the server hangs up its side,
+		// EPIPE once the server is gone
+		if (typing && ((typing = pump_run(&type, pfds[2].revents != 0)) <= 0)) {
+			if ((typing == -1) && (errno != EPIPE))
+				error_exit("m2s write");
+			typing = 0;
 			close(swfd);
-			exit(0);
 		}
-		// error
-		if (kbyte < 0)
-			error_exit("keyboard read");
-
-		//write to m2sFDs[WFD]
-		if (write(swfd, kbuf, kbyte) == -1)
-			error_exit("m2s write");
 	}
+	close(srfd);
 }
 
 
-
 /*
  * server - relays chat messages
  * @param mrfd - monitor read file descriptor
@@ -115,48 +179,44 @@ void server(int mrfd, int mwfd, int port) {
 	int acceptFD =  accept(socketFD, (struct sockaddr *)&client_addr, &addr_size);
 	if (acceptFD == -1) error_exit("accept");
 
-	int rbyte = 0;
-	int cbyte = 0;
-	char rbuf[1024], cbuf[1024];
-
-	while (1) {
-		// read from the server
-		// recv(0) == flag not specified
-		cbyte = recv(acceptFD, cbuf, sizeof(cbuf), 0);
-		// EOF
-		if (cbyte == 0) {
-			close(mrfd);
-			close(mwfd);
-			close(socketFD);
-			write(STDOUT_FILENO, "hanging up\n", 12);
-			exit(0);
+	static struct pump in, out;
+	struct pollfd pfds[4];
+	int reading = 1, writing = 1;
+
+	// client to monitor, monitor to client
+	in.from = acceptFD;
+	in.to = mwfd;
+	out.from = mrfd;
+	out.to = acceptFD;
+	fcntl(acceptFD, F_SETFL, fcntl(acceptFD, F_GETFL) | O_NONBLOCK);
+	fcntl(mrfd, F_SETFL, fcntl(mrfd, F_GETFL) | O_NONBLOCK);
+	fcntl(mwfd, F_SETFL, fcntl(mwfd, F_GETFL) | O_NONBLOCK);
+
+	// each way until its sender is done or its other end hung up, a dead client
+	// or monitor ends the other way too, with an error or EOF of its own
+	while (reading || writing) {
+		pump_poll(&in, &pfds[0], &pfds[1]);
+		pump_poll(&out, &pfds[2], &pfds[3]);
+		if (poll(pfds, 4, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			error_exit("poll server");
 		}
-		// error
-		if (cbyte < 0)
-			error_exit("server read");
-
-		// write to s2mFDs[WFD]
-		if (write(mwfd, cbuf, cbyte) == -1)
-			error_exit("s2m write");
-
-		// read from m2sFDs[RFD]
-		rbyte = read(mrfd, rbuf, sizeof(rbuf));
-		// EOF
-		if (rbyte == 0) {
-			close(mrfd);
+
+		// the client sent EOF, so does the monitor's display
+		if (reading && ((reading = pump_run(&in, pfds[0].revents != 0)) <= 0)) {
+			reading = 0;
 			close(mwfd);
-			close(socketFD);
-			write(STDOUT_FILENO, "hanging up\n", 12);
-			exit(0);
 		}
-		// error
-		if (rbyte < 0)
-			error_exit("server read");
-
-		// write to the server
-		if (send(acceptFD, rbuf, rbyte, 0) == -1)
-			error_exit("send");
+		// the monitor's keyboard sent EOF, nothing more goes to the client,
+		// no half-close, an EOF tells the client the server is gone
+		if (writing && ((writing = pump_run(&out, pfds[2].revents != 0)) <= 0))
+			writing = 0;
 	}
+
+	close(acceptFD);
+	close(socketFD);
+	write(STDOUT_FILENO, "hanging up\n", 12);
 }
 
 
@@ -180,6 +240,9 @@ int main(int argc, char **argv) {
 		}
 	}
 
+	// a client hanging up mid-write is an EPIPE, not a signal
+	signal(SIGPIPE, SIG_IGN);
+
 	// for server, s2mFDs[WFD] & m2sFDs[RFD]
 	// for monitor, s2mFDs[RFD] & m2sFDs[WFD]
 	int s2mFDs[2], m2sFDs[2];
@@ -0,0 +1,143 @@
+/*
+ * chatlog.h - the on-disk log of relayed messages, written by server.c -L and read by logdump.c
+ * 	     - a directory of preallocated segments NNNNNNNN.log, appended through mmap,
+ * 	       each with a sparse index NNNNNNNN.idx
+ *
+ * 	     segment: 0 magic | 8 lsn of its first record | 16 records, all zero until started
+ * 	     record:  0 len | 4 namelen | 8 lsn | 16 room name | frame | padding to 8
+ *
+ * 	     len is the size of the whole record, stored last, 0 where the records stop,
+ * 	     lsn numbers every record of every room in log order, all in host byte order
+ * 	     index: slot i holds 1 + offset of the record base + i * LOG_INDEX_EVERY, 0 if none
+ */
+
+#ifndef CHATLOG_H
+#define CHATLOG_H
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "frame.h"
+
+// bytes of one segment, allocated when it is created, cut to what was used once full
+#define LOG_SEGMENT (64 << 20)
+
+// bytes in front of the first record
+#define LOG_SEG_HDR 16
+#define LOG_MAGIC "chatlog1"
+
+// bytes in front of the room name of a record
+#define LOG_REC_HDR 16
+
+// every LOG_INDEX_EVERY-th record of a segment is in its index
+#define LOG_INDEX_EVERY 64
+
+// index slots, enough for a segment of the smallest records
+#define LOG_INDEX_SLOTS (LOG_SEGMENT / (LOG_REC_HDR + 8 + FRAME_HDR) / LOG_INDEX_EVERY + 1)
+
+struct log_seg_hdr {
+	char magic[8];
+	uint64_t base;
+};
+
+struct log_rec {
+	uint32_t len;
+	uint32_t namelen;
+	uint64_t lsn;
+	// room name, then the frame as relayed, seq stamped
+	char data[];
+};
+
+// bytes of a record for a room name and a frame
+static inline uint32_t log_rec_size(int namelen, int framelen) {
+	return (LOG_REC_HDR + namelen + framelen + 7) & ~7u;
+}
+
+// path of segment num, ext "log" or "idx"
+static inline void log_path(char* buf, size_t n, const char* dir, unsigned long num, const char* ext) {
+	snprintf(buf, n, "%s/%08lu.%s", dir, num, ext);
+}
+
+/*
+ * log_next - the record at *off, and move *off past it
+ * @param map - the segment
+ * @param size - its bytes
+ * @param off - offset of the record, LOG_SEG_HDR for the first one
+ * @returns the record, NULL where the records stop
+ */
+static inline const struct log_rec* log_next(const char* map, size_t size, size_t* off) {
+	const struct log_rec* r = (const struct log_rec*) (map + *off);
+	if (*off + LOG_REC_HDR > size)
+		return NULL;
+	uint32_t len = __atomic_load_n(&r->len, __ATOMIC_ACQUIRE);
+	if ((len < LOG_REC_HDR + FRAME_HDR) || (*off + len > size))
+		return NULL;
+	*off += len;
+	return r;
+}
+
+/*
+ * log_base - the lsn of the first record of a segment
+ * @param dir - the log directory
+ * @param num - the segment
+ * @param base - set to the lsn
+ * @returns 0, -1 if the segment is not started, a spare created ahead, or unreadable
+ */
+static inline int log_base(const char* dir, unsigned long num, uint64_t* base) {
+	char path[PATH_MAX];
+	struct log_seg_hdr h;
+	log_path(path, sizeof(path), dir, num, "log");
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -1;
+	int n = pread(fd, &h, sizeof(h), 0);
+	close(fd);
+	if ((n != sizeof(h)) || (memcmp(h.magic, LOG_MAGIC, sizeof(h.magic)) != 0))
+		return -1;
+	*base = h.base;
+	return 0;
+}
+
+static int log_num_cmp(const void* a, const void* b) {
+	unsigned long x = *(const unsigned long*) a, y = *(const unsigned long*) b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * log_list - the numbers of the segments in a log directory, in order
+ * @param dir - the directory
+ * @param nums - set to a malloc()ed array
+ * @returns # of segments, -1 if dir cannot be read
+ */
+static inline int log_list(const char* dir, unsigned long** nums) {
+	DIR* d = opendir(dir);
+	struct dirent* e;
+	int n = 0, cap = 16;
+	if (d == NULL)
+		return -1;
+	if ((*nums = malloc(cap * sizeof(unsigned long))) == NULL) {
+		closedir(d);
+		return -1;
+	}
+	while ((e = readdir(d)) != NULL) {
+		char* end;
+		unsigned long num = strtoul(e->d_name, &end, 10);
+		if ((end == e->d_name) || (strcmp(end, ".log") != 0))
+			continue;
+		if ((n == cap) && ((*nums = realloc(*nums, (cap *= 2) * sizeof(unsigned long))) == NULL))
+			break;
+		(*nums)[n++] = num;
+	}
+	closedir(d);
+	if (*nums == NULL)
+		return -1;
+	qsort(*nums, n, sizeof(unsigned long), log_num_cmp);
+	return n;
+}
+
+#endif
@@ -10,116 +10,441 @@
 #include <sys/socket.h>
 // AF_INET, sockaddr_in
 #include <netinet/in.h>
-// gethostbyaddr, gethostbyname
+// getaddrinfo()
 #include <netdb.h>
+// sockaddr_un
+#include <sys/un.h>
+// nanosleep()
+#include <time.h>
 // htons()
 #include <arpa/inet.h>
 // getopt()
 #include <unistd.h>
+// poll()
+#include <poll.h>
+// fcntl()
+#include <fcntl.h>
+// frame_encode(), frame_decode()
+#include "frame.h"
 
 void error_exit(const char* error) {
 	perror(error);
 	exit(-1);
 }
 
+// bytes of stdin read at once with -b, framed a line at a time
+#define BATCH_READ 65536
+
+// bytes of stdin read at once otherwise, a frame per read
+#define LINE_READ 1024
+
+// frames not acknowledged yet, stdin waits while they fill half of it
+#define OUT_BUF (1 << 18)
+
+// bytes read from the server at once
+#define IN_BUF (1 << 18)
+
+// ms before reconnecting, drawn at random up to a bound
+// that doubles from BACKOFF_MIN to BACKOFF_MAX with every failed attempt
+#define BACKOFF_MIN 50
+#define BACKOFF_MAX 5000
+
+// frames the server has not acknowledged, sent up to osent, pipelined into as few
+// sends as it takes, room past OUT_BUF for pongs, ack requests and the room to rejoin
+char obuf[OUT_BUF + 1024];
+int olen, osent;
+// frames of the connection in front of obuf, and the end of the last FRAME_ACK in it
+uint64_t obase;
+int asked;
+// the room as of the frames acknowledged, joined again after a reconnect, none for the lobby
+char room[64];
+int room_len;
+// reconnects failed since the server last answered, we shut down our side with -b
+int attempts, hung_up;
+
+int server_connect(const char* host, const char* port);
+int reconnect(const char* host, const char* port, int socketFD);
+void out_frame(uint8_t type, const char* payload, int len);
+int frame_input(const char* in, int len, int batch, int eof);
+int out_flush(int socketFD);
+void out_acked(uint64_t frames);
+void hang_up(int socketFD, int batch);
+
 int main(int argc, char** argv) {
 
 	// getopt()
-	int opt, port;
-	char* hostname;
-	while ((opt = getopt(argc, argv, "h:p:")) != -1) {
+	int opt, batch = 0;
+	char *hostname = NULL, *port = NULL;
+	while ((opt = getopt(argc, argv, "h:p:b")) != -1) {
 		switch(opt){
 			case 'p':
-				port = atoi(optarg);
+				port = optarg;
 				break;
 			case 'h':
 				hostname = optarg;
 				break;
+			// scripted feeding: stdin in large blocks, a frame per line,
+			// nothing printed but the messages
+			case 'b':
+				batch = 1;
+				break;
 		}
 	}
 
-	struct sockaddr_in serv_addr;
-	int socketFD;
-
-	memset(&serv_addr, 0, sizeof(serv_addr));
-
-	struct hostent* host = gethostbyname(hostname);
-	if (host == 0)
-		error_exit("gethostbyname");
-	serv_addr.sin_family = AF_INET;
-	memcpy(&serv_addr.sin_addr, host->h_addr, host->h_length);
-	serv_addr.sin_port = htons(port);
-
-	if ((socketFD = socket(AF_INET, SOCK_STREAM, 0)) == -1) error_exit("socket");
-
-	// connect
-	if(connect(socketFD, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
-		close(socketFD);
-		error_exit("connect");
+	if ((hostname == NULL) || (port == NULL)) {
+		fprintf(stderr, "usage: %s -h host|unix:path -p port [-b]\n", argv[0]);
+		exit(-1);
 	}
 
-	write(STDOUT_FILENO, "connected to server...\n\n", sizeof("connected to server...\n\n"));
+	// connect, only reconnects are retried
+	int socketFD = server_connect(hostname, port);
+	if (socketFD == -1)
+		exit(-1);
+	srandom(getpid() ^ time(NULL));
+
+	if (!batch)
+		write(STDOUT_FILENO, "connected to server...\n\n", sizeof("connected to server...\n\n"));
+	// frames are queued while the server is behind, never blocking its messages
+	fcntl(socketFD, F_SETFL, fcntl(socketFD, F_GETFL) | O_NONBLOCK);
 
 	// chat
 
-	fd_set readFDs;
-	int fdmax = socketFD;
-	int rbyte, kbyte;
-	char rbuf[1024], kbuf[1024];
+	// ibuf holds what stdin sent and was not framed yet, a partial line with -b,
+	// rbuf a partial frame at its front between reads, dbuf the messages of one read
+	static char ibuf[BATCH_READ], rbuf[IN_BUF], dbuf[IN_BUF];
+	int ilen = 0, rlen = 0, eof = 0, rbyte, kbyte;
+	struct pollfd pfds[2] = { { STDIN_FILENO, POLLIN, 0 }, { socketFD, POLLIN, 0 } };
 	while(1) {
 
-		FD_ZERO(&readFDs);
-		FD_SET(STDIN_FILENO, &readFDs);
-		FD_SET(socketFD, &readFDs);
-		struct timeval tv;
-		tv.tv_sec = 0;
-		// timeout == 0.1 second
-		tv.tv_usec = 100000;
-		if (select(fdmax + 1, &readFDs, 0, 0, &tv) == -1)
-			error_exit("select client");
-
-		for (int i = 0; i <= fdmax; i++) {
-			if (FD_ISSET(i, &readFDs)) {
-				// STDIN_FILENO is set
-				if (i == STDIN_FILENO) {
-					// read from the keyboard
-					if ((kbyte = read(STDIN_FILENO, kbuf, sizeof(kbuf))) == -1)
-						error_exit("keyboard error");
-					// EOF
-					if (kbyte == 0) {
-						close(socketFD);
-						write(STDOUT_FILENO, "hanging up\n", 12);
-						exit(0);
-					}
-					else {
-						// write to the server
-						if (send(socketFD, kbuf, kbyte, 0) == -1)
-							error_exit("server write");
-					}
+		// no timeout, stdin sits out while the server is behind
+		pfds[0].fd = (!eof && (olen < OUT_BUF / 2)) ? STDIN_FILENO : -1;
+		pfds[1].events = (olen > osent) ? POLLIN | POLLOUT : POLLIN;
+		if (poll(pfds, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			error_exit("poll client");
+		}
+
+		// stdin is ready
+		if (pfds[0].revents) {
+			// read from the keyboard, or a script
+			int want = batch ? BATCH_READ - ilen : LINE_READ;
+			if ((kbyte = read(STDIN_FILENO, ibuf + ilen, want)) == -1)
+				error_exit("keyboard error");
+			// EOF, hang up once everything is acknowledged
+			if (kbyte == 0)
+				eof = 1;
+			ilen += kbyte;
+		}
+		// frame what fits
+		if (ilen > 0) {
+			int used = frame_input(ibuf, ilen, batch, eof);
+			memmove(ibuf, ibuf + used, ilen - used);
+			ilen -= used;
+		}
+
+		// socketFD is readable
+		if (pfds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+			// read from the server, behind the partial frame
+			rbyte = recv(socketFD, rbuf + rlen, sizeof(rbuf) - rlen, 0);
+			// EOF or error, the server went away
+			if ((rbyte == 0) || ((rbyte < 0) && (errno != EAGAIN) && (errno != EINTR))) {
+				// everything was acknowledged before we hung up
+				if (hung_up) {
+					close(socketFD);
+					exit(0);
 				}
+				pfds[1].fd = socketFD = reconnect(hostname, port, socketFD);
+				rlen = 0;
+				continue;
+			}
+			rlen += (rbyte > 0) ? rbyte : 0;
 
-				// socketFD is set
-				if (i == socketFD) {
-					// read from the server
-					rbyte = recv(socketFD, rbuf, sizeof(rbuf), 0);
-					// EOF
-					if (rbyte == 0) {
-						close(socketFD);
-						write(STDOUT_FILENO, "hanging up\n", 12);
-						exit(0);
-					}
-					// error
-					if (rbyte < 0)
-						error_exit("server read");
-
-					// write onto display
-					if (write(STDOUT_FILENO, rbuf, rbyte) == -1)
-						error_exit("display write");
+			// write the complete frames onto display, one write for the whole read
+			struct frame f;
+			int off = 0, dlen = 0, n, refused = 0;
+			while (((n = frame_decode(rbuf + off, rlen - off, &f)) > 0) && (n <= rlen - off)) {
+				if (f.type == FRAME_MSG) {
+					memcpy(dbuf + dlen, rbuf + off + FRAME_HDR, f.len);
+					dlen += f.len;
+				}
+				// the server checking we are still here, dropped if a few are waiting
+				if ((f.type == FRAME_PING) && !hung_up && (olen + FRAME_HDR <= OUT_BUF + 512))
+					out_frame(FRAME_PONG, NULL, 0);
+				if (f.type == FRAME_ACK)
+					out_acked(f.seq);
+				// turned away, the notice says why, nothing more comes
+				if (f.type == FRAME_FULL) {
+					write(STDERR_FILENO, rbuf + off + FRAME_HDR, f.len);
+					refused = 1;
+					break;
+				}
+				off += n;
+			}
+			if ((dlen > 0) && (write(STDOUT_FILENO, dbuf, dlen) == -1))
+				error_exit("display write");
+			if (n < 0) {
+				fprintf(stderr, "bad frame from server\n");
+				exit(-1);
+			}
+			// try again later, the backoff keeps growing until a server acknowledges us
+			if (refused) {
+				if (hung_up) {
+					close(socketFD);
+					exit(0);
 				}
+				pfds[1].fd = socketFD = reconnect(hostname, port, socketFD);
+				rlen = 0;
+				continue;
 			}
+
+			// keep the partial frame
+			memmove(rbuf, rbuf + off, rlen - off);
+			rlen -= off;
+		}
+
+		// one answer acknowledges everything queued before the question
+		if ((olen > asked) && !hung_up) {
+			out_frame(FRAME_ACK, NULL, 0);
+			asked = olen;
+		}
+		// socketFD is writable, or was just given frames
+		if ((olen > osent) && !hung_up && (out_flush(socketFD) == -1)) {
+			pfds[1].fd = socketFD = reconnect(hostname, port, socketFD);
+			rlen = 0;
+			continue;
+		}
+		if (eof && (ilen == 0) && (olen == 0))
+			hang_up(socketFD, batch);
+	}
+
+	close(socketFD);
+	return 0;
+}
+
+/*
+ * server_connect - connect to the server
+ * 		  - tries every address getaddrinfo() has for host, IPv6 and IPv4, in its order
+ * @param host - name or address of the server, unix:path for a unix socket
+ * @param port - its port, or service name
+ * @returns the socket, -1 if no address took it, the reason is printed
+ */
+int server_connect(const char* host, const char* port) {
+	int fd = -1;
+
+	if (strncmp(host, "unix:", 5) == 0) {
+		struct sockaddr_un addr = { .sun_family = AF_UNIX };
+		strncpy(addr.sun_path, host + 5, sizeof(addr.sun_path) - 1);
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+			error_exit("socket");
+		if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+			perror(host);
+			close(fd);
+			return -1;
 		}
+		return fd;
 	}
 
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *ai, *a;
+	int err = getaddrinfo(host, port, &hints, &ai);
+	if (err != 0) {
+		fprintf(stderr, "%s: %s\n", host, gai_strerror(err));
+		return -1;
+	}
+	for (a = ai; a; a = a->ai_next) {
+		if ((fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol)) == -1)
+			continue;
+		if (connect(fd, a->ai_addr, a->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	if (fd == -1)
+		perror(host);
+	freeaddrinfo(ai);
+	return fd;
+}
+
+/*
+ * reconnect - connect again once the server went away, and queue what it did not
+ * 	       acknowledge to be sent again, after rejoining the room
+ * 	     - waits a random time up to a bound that doubles with every failed attempt,
+ * 	       so clients of a restarting server do not all come back at once
+ * 	     - frames the server took but had not acknowledged are sent twice
+ * @param host - as for server_connect()
+ * @param port - as for server_connect()
+ * @param socketFD - the dead socket, closed
+ * @returns the new socket
+ */
+int reconnect(const char* host, const char* port, int socketFD) {
+	static char tmp[sizeof(obuf)];
+	int fd = -1, len = 0;
+
 	close(socketFD);
+	while (fd == -1) {
+		long bound = BACKOFF_MIN << ((attempts < 10) ? attempts : 10);
+		if (bound > BACKOFF_MAX)
+			bound = BACKOFF_MAX;
+		long ms = 1 + random() % bound;
+		attempts++;
+		fprintf(stderr, "reconnecting in %ld ms\n", ms);
+		struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+		nanosleep(&ts, NULL);
+		fd = server_connect(host, port);
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	// the room first, then every frame but the questions and answers of the old connection
+	if (room_len > 0) {
+		frame_encode(tmp, FRAME_JOIN, room_len);
+		memcpy(tmp + FRAME_HDR, room, room_len);
+		len = FRAME_HDR + room_len;
+	}
+	struct frame f = { 0 };
+	for (int off = 0, n; off < olen; off += n) {
+		n = frame_decode(obuf + off, olen - off, &f);
+		if ((f.type == FRAME_ACK) || (f.type == FRAME_PONG))
+			continue;
+		memcpy(tmp + len, obuf + off, n);
+		len += n;
+	}
+	memcpy(obuf, tmp, len);
+	olen = len;
+	osent = 0;
+	obase = 0;
+	asked = 0;
+	return fd;
+}
+
+/*
+ * out_frame - queue a frame for the server
+ * @param type - enum frame_type
+ * @param payload - its payload, NULL if len is 0
+ * @param len - # of bytes of payload
+ */
+void out_frame(uint8_t type, const char* payload, int len) {
+	frame_encode(obuf + olen, type, len);
+	if (len > 0)
+		memcpy(obuf + olen + FRAME_HDR, payload, len);
+	olen += FRAME_HDR + len;
+}
+
+/*
+ * frame_input - queue frames for what stdin sent, as far as they fit under OUT_BUF
+ * 	       - "/join room" and "/leave" change rooms, "/history" replays the room's
+ * 		 recent messages, so does joining, anything else is chat
+ * @param in - the bytes from stdin
+ * @param len - # of bytes
+ * @param batch - a frame per line, otherwise the whole of in is one frame
+ * @param eof - stdin is done, a last line without a newline is framed too
+ * @returns # of bytes of in framed
+ */
+int frame_input(const char* in, int len, int batch, int eof) {
+	int off = 0;
+
+	while (off < len) {
+		const char* payload = in + off;
+		int n = len - off;
+		if (batch) {
+			const char* nl = memchr(payload, '\n', (n < FRAME_MAX) ? n : FRAME_MAX);
+			if (nl)
+				n = nl - payload + 1;
+			// wait for the rest of the line, unless it will not fit in a frame
+			else if ((n < FRAME_MAX) && !eof)
+				break;
+			else if (n > FRAME_MAX)
+				n = FRAME_MAX;
+		}
+		// the frame, and a history request after it
+		if (olen + 2 * FRAME_HDR + n + 8 > OUT_BUF)
+			break;
+		int history = 0;
+		if ((n > 6) && (strncmp(payload, "/join ", 6) == 0)) {
+			out_frame(FRAME_JOIN, payload + 6, n - 6);
+			history = 1;
+		}
+		else if ((n >= 6) && (strncmp(payload, "/leave", 6) == 0))
+			out_frame(FRAME_LEAVE, NULL, 0);
+		else if ((n >= 8) && (strncmp(payload, "/history", 8) == 0))
+			history = 1;
+		else
+			out_frame(FRAME_MSG, payload, n);
+
+		// everything the server still keeps, after seq 0
+		if (history) {
+			char after[8] = { 0 };
+			out_frame(FRAME_HISTORY, after, 8);
+		}
+		off += n;
+	}
+	return off;
+}
+
+/*
+ * out_flush - send the queued frames, as many per send() as the socket takes
+ * 	     - they stay queued until acknowledged
+ * @param socketFD - the server
+ * @returns 0, -1 if the server went away
+ */
+int out_flush(int socketFD) {
+	int n;
+
+	while (osent < olen) {
+		if ((n = send(socketFD, obuf + osent, olen - osent, MSG_NOSIGNAL)) == -1) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				break;
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		osent += n;
+	}
 	return 0;
 }
+
+/*
+ * out_acked - forget the frames the server acknowledged
+ * @param frames - # of frames it took on this connection, the seq of its FRAME_ACK
+ */
+void out_acked(uint64_t frames) {
+	struct frame f = { 0 };
+	int off = 0, n;
+
+	while ((obase < frames) && (off < osent)) {
+		n = frame_decode(obuf + off, olen - off, &f);
+		// the room to rejoin
+		if ((f.type == FRAME_JOIN) && (f.len <= sizeof(room))) {
+			memcpy(room, obuf + off + FRAME_HDR, f.len);
+			room_len = f.len;
+		}
+		else if (f.type == FRAME_LEAVE)
+			room_len = 0;
+		off += n;
+		obase++;
+	}
+	memmove(obuf, obuf + off, olen - off);
+	olen -= off;
+	osent -= off;
+	asked = (asked > off) ? asked - off : 0;
+	attempts = 0;
+}
+
+/*
+ * hang_up - done sending, once stdin is done and everything is acknowledged
+ * 	   - with -b, tells the server and keeps reading until it hangs up,
+ * 	     which it does once everything queued for us is sent
+ * @param socketFD - the server
+ * @param batch - -b
+ */
+void hang_up(int socketFD, int batch) {
+	if (hung_up)
+		return;
+	hung_up = 1;
+	if (batch) {
+		shutdown(socketFD, SHUT_WR);
+		return;
+	}
+	close(socketFD);
+	write(STDOUT_FILENO, "hanging up\n", 12);
+	exit(0);
+}
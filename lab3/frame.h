@@ -0,0 +1,124 @@
+/*
+ * frame.h - the chat protocol shared by client.c and server.c
+ * 	   - every message is a frame, a 16-byte header and a payload
+ *
+ * 	   0       4      5       6          8     16
+ * 	   | len   | type | flags | reserved | seq | payload (len bytes)
+ *
+ * 	   len is the payload length, seq the number the server gave a message in its room,
+ * 	   0 from clients, both in network byte order
+ */
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+#include <arpa/inet.h>
+
+// bytes of the header
+#define FRAME_HDR 16
+
+// largest payload, a whole frame fits in one of the server's buffers
+#define FRAME_MAX (16384 - FRAME_HDR)
+
+// what a frame carries
+enum frame_type {
+	// chat text, relayed to everyone else in the sender's room
+	FRAME_MSG = 1,
+	// move to the room named by the payload, created if it does not exist
+	FRAME_JOIN = 2,
+	// go back to the lobby, no payload
+	FRAME_LEAVE = 3,
+	// replay the room's history after the seq in the payload, 8 bytes, 0 for all of it
+	FRAME_HISTORY = 4,
+	// are you there, sent by the server to a client that went quiet, no payload
+	FRAME_PING = 5,
+	// the answer to a FRAME_PING, no payload
+	FRAME_PONG = 6,
+	// from a client, which of my frames have you taken, no payload,
+	// the answer has seq set to the # of frames taken on the connection, this one included
+	FRAME_ACK = 7,
+	// from the server, it is full and hangs up, the payload a notice to show
+	FRAME_FULL = 8,
+};
+
+// flags
+// a FRAME_MSG replayed from the room's history
+#define FRAME_F_HISTORY 1
+
+// a decoded header
+struct frame {
+	uint32_t len;
+	uint8_t type;
+	uint8_t flags;
+	uint64_t seq;
+};
+
+/*
+ * frame_encode - write a header in front of a payload
+ * @param buf - FRAME_HDR bytes, the payload follows
+ * @param type - enum frame_type
+ * @param len - # of bytes of payload
+ */
+static inline void frame_encode(char* buf, uint8_t type, uint32_t len) {
+	uint32_t nlen = htonl(len);
+	memcpy(buf, &nlen, 4);
+	buf[4] = type;
+	buf[5] = 0;
+	buf[6] = buf[7] = 0;
+	memset(buf + 8, 0, 8);
+}
+
+/*
+ * frame_stamp - set the seq of an encoded header
+ * @param buf - the header
+ * @param seq - the message's number in its room
+ */
+static inline void frame_stamp(char* buf, uint64_t seq) {
+	uint64_t nseq = htobe64(seq);
+	memcpy(buf + 8, &nseq, 8);
+}
+
+/*
+ * frame_decode - read the header of the frame at buf
+ * @param buf - start of the frame
+ * @param have - # of bytes received from buf on
+ * @param f - the header, set when it is complete
+ * @returns size of the whole frame, 0 if the header is incomplete, -1 if it is invalid
+ */
+static inline int frame_decode(const char* buf, int have, struct frame* f) {
+	uint32_t nlen;
+	uint64_t nseq;
+	if (have < FRAME_HDR)
+		return 0;
+	memcpy(&nlen, buf, 4);
+	memcpy(&nseq, buf + 8, 8);
+	f->len = ntohl(nlen);
+	f->type = buf[4];
+	f->flags = buf[5];
+	f->seq = be64toh(nseq);
+	if (f->len > FRAME_MAX)
+		return -1;
+	return FRAME_HDR + f->len;
+}
+
+/*
+ * frame_need - # of bytes still missing from the frame at buf
+ * 	      - the header first, if that is incomplete
+ * @param buf - start of the frame
+ * @param have - # of bytes received from buf on
+ * @returns 0 if the frame is complete, -1 if it is invalid
+ */
+static inline int frame_need(const char* buf, int have) {
+	struct frame f;
+	int n = frame_decode(buf, have, &f);
+	if (n == 0)
+		return FRAME_HDR - have;
+	if (n < 0)
+		return -1;
+	return (n > have) ? n - have : 0;
+}
+
+#endif
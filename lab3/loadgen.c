@@ -0,0 +1,517 @@
+/*
+ * loadgen.c - drives the chat server with many framed connections and measures it
+ * 	     - gcc -pthread, -j worker threads each own a slice of the connections
+ * 	     - each message carries the time it was due, every receiver turns that into latency
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+// frame_encode(), frame_decode()
+#include "frame.h"
+
+// defaults for -c, -s, -r, -d, -b, -w
+#define CONNS 1000
+#define SENDERS 1
+#define RATE 1000
+#define SECONDS 5
+#define PAYLOAD 64
+#define WARMUP_MS 500
+
+// most worker threads, -j
+#define MAX_WORKERS 64
+
+// bytes one recv() reads, behind the partial frame carried over from the last one
+#define RECV_SIZE 65536
+
+// bytes queued for one sender while the socket is full, frames that do not fit are skipped
+#define OUT_SIZE 65536
+
+// maximum number of events returned by one epoll_wait()
+#define MAX_EVENTS 256
+
+// latency histogram, 16 linear sub-buckets per power of 2, so about 6% precision
+#define HIST_SUB 16
+#define HIST (64 * HIST_SUB)
+
+// marks the frames loadgen sent, notices and monitor text are ignored
+#define STAMP_MAGIC "lg01"
+
+// front of every payload, the rest is filler ending in '\n'
+struct stamp {
+	char magic[4];
+	uint32_t sender;
+	// CLOCK_MONOTONIC ns the message was due, not when it went out,
+	// so a send loop that falls behind shows up as latency
+	uint64_t due;
+};
+
+// one connection to the server
+struct lconn {
+	int fd;
+	// the room it joined, an index into fanout[]
+	int room;
+	// partial frame left over from the last recv(), allocated on first use
+	char* part;
+	int plen;
+	// bytes the socket did not take yet, allocated on first use
+	char* out;
+	int olen;
+};
+
+// a thread and the connections it owns
+struct worker {
+	pthread_t tid;
+	int epfd;
+	struct lconn* conns;
+	int n;
+	// its sending connections, and its share of -r
+	struct lconn** senders;
+	int nsend;
+	double rate;
+	// messages sent, and the ones skipped because the sender was backed up
+	uint64_t sent, skipped;
+	// deliveries the sent messages should cause, and the ones seen
+	uint64_t expected, delivered, bytes;
+	uint64_t hist[HIST];
+	char rbuf[FRAME_HDR + FRAME_MAX + RECV_SIZE];
+};
+
+struct options {
+	int conns, senders, rate, seconds, payload, group, workers, warmup;
+};
+
+// phases, in CLOCK_MONOTONIC ns: warm up until start, send until end, drain until stop
+uint64_t start_ns, end_ns, stop_ns;
+
+// receivers of a message sent in each room, its size less the sender
+int* fanout;
+
+struct options opts = {CONNS, SENDERS, RATE, SECONDS, PAYLOAD, 0, 1, WARMUP_MS};
+
+void error_exit(const char* error) {
+	perror(error);
+	exit(-1);
+}
+
+uint64_t now_ns(void);
+void* worker_run(void* arg);
+void conn_read(struct worker* w, struct lconn* c, uint64_t now);
+void conn_write(struct worker* w, struct lconn* c, const char* buf, int len);
+void conn_drain(struct worker* w, struct lconn* c);
+int hist_bucket(uint64_t v);
+uint64_t hist_value(int i);
+uint64_t hist_percentile(const uint64_t* hist, uint64_t total, double p);
+
+void usage(const char* prog) {
+	fprintf(stderr, "usage: %s -h host -p port [-c conns] [-s senders] [-r msgs/s] [-d seconds]\n"
+			"       [-b payload bytes] [-g room size] [-j threads] [-w warmup ms]\n", prog);
+	exit(-1);
+}
+
+int main(int argc, char** argv) {
+
+	// getopt()
+	int opt, port = 0;
+	char* hostname = NULL;
+	while ((opt = getopt(argc, argv, "h:p:c:s:r:d:b:g:j:w:")) != -1) {
+		switch(opt){
+			case 'h':
+				hostname = optarg;
+				break;
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 'c':
+				opts.conns = atoi(optarg);
+				break;
+			case 's':
+				opts.senders = atoi(optarg);
+				break;
+			case 'r':
+				opts.rate = atoi(optarg);
+				break;
+			case 'd':
+				opts.seconds = atoi(optarg);
+				break;
+			case 'b':
+				opts.payload = atoi(optarg);
+				break;
+			case 'g':
+				opts.group = atoi(optarg);
+				break;
+			case 'j':
+				opts.workers = atoi(optarg);
+				break;
+			case 'w':
+				opts.warmup = atoi(optarg);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if ((hostname == NULL) || (port <= 0) || (opts.conns < 2) || (opts.senders < 1) || (opts.rate < 1) ||
+	    (opts.seconds < 1) || (opts.workers < 1) || (opts.workers > MAX_WORKERS) || (opts.group < 0) || (opts.warmup < 0))
+		usage(argv[0]);
+	if (opts.senders > opts.conns)
+		opts.senders = opts.conns;
+	if (opts.workers > opts.conns)
+		opts.workers = opts.conns;
+	if (opts.payload < (int) sizeof(struct stamp) + 1)
+		opts.payload = sizeof(struct stamp) + 1;
+	if (opts.payload > FRAME_MAX)
+		opts.payload = FRAME_MAX;
+
+	// every connection is an fd, raise the soft limit as far as allowed
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	struct sockaddr_in serv_addr;
+	memset(&serv_addr, 0, sizeof(serv_addr));
+	struct hostent* host = gethostbyname(hostname);
+	if (host == 0)
+		error_exit("gethostbyname");
+	serv_addr.sin_family = AF_INET;
+	memcpy(&serv_addr.sin_addr, host->h_addr, host->h_length);
+	serv_addr.sin_port = htons(port);
+
+	// rooms of -g connections, dealt round robin so the first -s senders land in different rooms
+	int nrooms = (opts.group > 0) ? (opts.conns + opts.group - 1) / opts.group : 1;
+	if ((fanout = calloc(nrooms, sizeof(int))) == NULL)
+		error_exit("calloc");
+	struct lconn* conns = calloc(opts.conns, sizeof(struct lconn));
+	if (conns == NULL)
+		error_exit("calloc");
+
+	for (int i = 0; i < opts.conns; i++) {
+		struct lconn* c = &conns[i];
+		if ((c->fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+			error_exit("socket");
+		if (connect(c->fd, (struct sockaddr*) &serv_addr, sizeof(serv_addr)) == -1) {
+			fprintf(stderr, "connected %d of %d\n", i, opts.conns);
+			error_exit("connect");
+		}
+		int one = 1;
+		setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		c->room = i % nrooms;
+		fanout[c->room]++;
+
+		if (opts.group > 0) {
+			char join[FRAME_HDR + 16];
+			int len = snprintf(join + FRAME_HDR, sizeof(join) - FRAME_HDR, "lg%d", c->room);
+			frame_encode(join, FRAME_JOIN, len);
+			if (send(c->fd, join, FRAME_HDR + len, 0) == -1)
+				error_exit("join");
+		}
+	}
+	for (int r = 0; r < nrooms; r++)
+		fanout[r]--;
+
+	// contiguous slices, each worker sends for the senders in its slice
+	struct worker* workers = calloc(opts.workers, sizeof(struct worker));
+	if (workers == NULL)
+		error_exit("calloc");
+	for (int j = 0, lo = 0; j < opts.workers; j++) {
+		struct worker* w = &workers[j];
+		int hi = (int) ((long) opts.conns * (j + 1) / opts.workers);
+		w->conns = &conns[lo];
+		w->n = hi - lo;
+		if ((w->senders = calloc(w->n, sizeof(struct lconn*))) == NULL)
+			error_exit("calloc");
+		for (int i = lo; (i < hi) && (i < opts.senders); i++)
+			w->senders[w->nsend++] = &conns[i];
+		w->rate = (double) opts.rate * w->nsend / opts.senders;
+		lo = hi;
+	}
+
+	start_ns = now_ns() + (uint64_t) opts.warmup * 1000000;
+	end_ns = start_ns + (uint64_t) opts.seconds * 1000000000;
+	// as long again as the warm-up for the last deliveries to arrive, at least 100 ms
+	stop_ns = end_ns + ((opts.warmup > 100) ? opts.warmup : 100) * (uint64_t) 1000000;
+
+	for (int j = 0; j < opts.workers; j++)
+		if (pthread_create(&workers[j].tid, NULL, worker_run, &workers[j]) != 0)
+			error_exit("pthread_create");
+
+	// add up the workers
+	uint64_t sent = 0, skipped = 0, expected = 0, delivered = 0, bytes = 0;
+	uint64_t* hist = calloc(HIST, sizeof(uint64_t));
+	if (hist == NULL)
+		error_exit("calloc");
+	for (int j = 0; j < opts.workers; j++) {
+		struct worker* w = &workers[j];
+		pthread_join(w->tid, NULL);
+		sent += w->sent;
+		skipped += w->skipped;
+		expected += w->expected;
+		delivered += w->delivered;
+		bytes += w->bytes;
+		for (int i = 0; i < HIST; i++)
+			hist[i] += w->hist[i];
+	}
+
+	double secs = opts.seconds;
+	printf("conns %d  senders %d  rooms %d  rate %d/s  payload %d B  threads %d  %d s\n",
+	       opts.conns, opts.senders, nrooms, opts.rate, opts.payload, opts.workers, opts.seconds);
+	printf("sent      %lu (%.0f/s), %lu skipped while backed up\n",
+	       (unsigned long) sent, sent / secs, (unsigned long) skipped);
+	printf("delivered %lu of %lu (%.1f%%), %.0f/s, %.1f MB/s\n",
+	       (unsigned long) delivered, (unsigned long) expected, expected ? 100.0 * delivered / expected : 0.0,
+	       delivered / secs, bytes / secs / 1e6);
+	if (delivered > 0)
+		printf("latency us  p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+		       hist_percentile(hist, delivered, 0.50) / 1e3, hist_percentile(hist, delivered, 0.99) / 1e3,
+		       hist_percentile(hist, delivered, 0.999) / 1e3, hist_percentile(hist, delivered, 1.0) / 1e3);
+
+	for (int i = 0; i < opts.conns; i++)
+		close(conns[i].fd);
+	return 0;
+}
+
+uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * worker_run - reads every connection of the worker, and sends on schedule
+ * 	      - open loop, message k is due at start_ns + k / rate whatever came back
+ * @param arg - the worker
+ */
+void* worker_run(void* arg) {
+	struct worker* w = arg;
+	struct epoll_event ev, events[MAX_EVENTS];
+	char frame[FRAME_HDR + FRAME_MAX];
+	uint64_t k = 0;
+
+	if ((w->epfd = epoll_create1(0)) == -1)
+		error_exit("epoll_create1");
+	for (int i = 0; i < w->n; i++) {
+		ev.events = EPOLLIN;
+		ev.data.ptr = &w->conns[i];
+		if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->conns[i].fd, &ev) == -1)
+			error_exit("epoll_ctl");
+	}
+
+	// the filler is the same for every message
+	frame_encode(frame, FRAME_MSG, opts.payload);
+	memset(frame + FRAME_HDR, 'x', opts.payload);
+	frame[FRAME_HDR + opts.payload - 1] = '\n';
+	struct stamp* st = (struct stamp*) (frame + FRAME_HDR);
+	memcpy(st->magic, STAMP_MAGIC, 4);
+
+	for (;;) {
+		uint64_t now = now_ns();
+		if (now >= stop_ns)
+			break;
+
+		// send whatever is due
+		uint64_t next = stop_ns;
+		if ((w->nsend > 0) && (now < end_ns)) {
+			for (;;) {
+				uint64_t due = start_ns + (uint64_t) (k * 1e9 / w->rate);
+				if ((due > now) || (due >= end_ns)) {
+					if (due < end_ns)
+						next = due;
+					break;
+				}
+				struct lconn* c = w->senders[k % w->nsend];
+				st->sender = c - w->conns;
+				st->due = due;
+				if (c->olen + FRAME_HDR + opts.payload > OUT_SIZE)
+					w->skipped++;
+				else {
+					conn_write(w, c, frame, FRAME_HDR + opts.payload);
+					w->sent++;
+					w->expected += fanout[c->room];
+				}
+				k++;
+			}
+		}
+
+		// round down, spins through the last millisecond before a message is due
+		int timeout = (int) ((next - now) / 1000000);
+		int n = epoll_wait(w->epfd, events, MAX_EVENTS, timeout);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			error_exit("epoll_wait");
+		}
+		now = now_ns();
+		for (int i = 0; i < n; i++) {
+			struct lconn* c = events[i].data.ptr;
+			if (events[i].events & EPOLLOUT)
+				conn_drain(w, c);
+			if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				conn_read(w, c, now);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * conn_read - reads what the server sent and records the latency of every stamped frame
+ * @param w - the worker
+ * @param c - the connection
+ * @param now - when epoll_wait() returned
+ */
+void conn_read(struct worker* w, struct lconn* c, uint64_t now) {
+	// the partial frame goes in front, so every frame is contiguous
+	if (c->plen > 0)
+		memcpy(w->rbuf, c->part, c->plen);
+	int rbyte = recv(c->fd, w->rbuf + c->plen, RECV_SIZE, MSG_DONTWAIT);
+	if (rbyte == 0) {
+		fprintf(stderr, "server hung up\n");
+		exit(-1);
+	}
+	if (rbyte < 0) {
+		if ((errno == EAGAIN) || (errno == EINTR))
+			return;
+		error_exit("recv");
+	}
+
+	struct frame f;
+	int have = c->plen + rbyte, off = 0, n;
+	while (((n = frame_decode(w->rbuf + off, have - off, &f)) > 0) && (n <= have - off)) {
+		struct stamp st;
+		if ((f.type == FRAME_MSG) && (f.len >= sizeof(st))) {
+			memcpy(&st, w->rbuf + off + FRAME_HDR, sizeof(st));
+			if ((memcmp(st.magic, STAMP_MAGIC, 4) == 0) && (st.due >= start_ns)) {
+				w->delivered++;
+				w->bytes += n;
+				w->hist[hist_bucket((now > st.due) ? now - st.due : 0)]++;
+			}
+		}
+		// a receiver that never sends must still answer, or the server hangs up, -I
+		else if ((f.type == FRAME_PING) && (c->olen + FRAME_HDR <= OUT_SIZE)) {
+			char pong[FRAME_HDR];
+			frame_encode(pong, FRAME_PONG, 0);
+			conn_write(w, c, pong, FRAME_HDR);
+		}
+		// more connections than the server's -c
+		else if (f.type == FRAME_FULL) {
+			fprintf(stderr, "%.*s", (int) f.len, w->rbuf + off + FRAME_HDR);
+			exit(-1);
+		}
+		off += n;
+	}
+	if (n < 0) {
+		fprintf(stderr, "bad frame from server\n");
+		exit(-1);
+	}
+
+	// keep the partial frame
+	c->plen = have - off;
+	if (c->plen > 0) {
+		if ((c->part == NULL) && ((c->part = malloc(FRAME_HDR + FRAME_MAX)) == NULL))
+			error_exit("malloc");
+		memcpy(c->part, w->rbuf + off, c->plen);
+	}
+}
+
+/*
+ * conn_write - sends a frame, queueing what the socket does not take
+ * @param w - the worker
+ * @param c - the connection, with room for len bytes in its queue
+ * @param buf - the frame
+ * @param len - its size
+ */
+void conn_write(struct worker* w, struct lconn* c, const char* buf, int len) {
+	int sent = 0;
+	if (c->olen == 0) {
+		sent = send(c->fd, buf, len, MSG_DONTWAIT);
+		if (sent == -1) {
+			if ((errno != EAGAIN) && (errno != EINTR))
+				error_exit("send");
+			sent = 0;
+		}
+		if (sent == len)
+			return;
+	}
+
+	if ((c->out == NULL) && ((c->out = malloc(OUT_SIZE)) == NULL))
+		error_exit("malloc");
+	if (c->olen == 0) {
+		struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT, .data.ptr = c};
+		if (epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev) == -1)
+			error_exit("epoll_ctl");
+	}
+	memcpy(c->out + c->olen, buf + sent, len - sent);
+	c->olen += len - sent;
+}
+
+/*
+ * conn_drain - sends what was queued once the socket has room again
+ * @param w - the worker
+ * @param c - the connection
+ */
+void conn_drain(struct worker* w, struct lconn* c) {
+	int sent = send(c->fd, c->out, c->olen, MSG_DONTWAIT);
+	if (sent == -1) {
+		if ((errno == EAGAIN) || (errno == EINTR))
+			return;
+		error_exit("send");
+	}
+	memmove(c->out, c->out + sent, c->olen - sent);
+	c->olen -= sent;
+	if (c->olen == 0) {
+		struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+		if (epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev) == -1)
+			error_exit("epoll_ctl");
+	}
+}
+
+/*
+ * hist_bucket - the histogram bucket of a latency
+ * 	       - exact below HIST_SUB, then HIST_SUB buckets per power of 2
+ * @param v - ns
+ */
+int hist_bucket(uint64_t v) {
+	if (v < HIST_SUB)
+		return v;
+	int b = 63 - __builtin_clzll(v);
+	return (b - 3) * HIST_SUB + ((v >> (b - 4)) & (HIST_SUB - 1));
+}
+
+// the smallest latency in bucket i, ns
+uint64_t hist_value(int i) {
+	if (i < HIST_SUB)
+		return i;
+	int b = i / HIST_SUB + 3;
+	return (uint64_t) (HIST_SUB + i % HIST_SUB) << (b - 4);
+}
+
+/*
+ * hist_percentile - the latency below which a fraction of the deliveries fall
+ * @param hist - HIST buckets
+ * @param total - # of deliveries in hist
+ * @param p - the fraction, 1.0 for the maximum
+ * @returns ns, the bottom of the bucket it falls in
+ */
+uint64_t hist_percentile(const uint64_t* hist, uint64_t total, double p) {
+	uint64_t rank = (uint64_t) (p * total), seen = 0;
+	if (rank >= total)
+		rank = total - 1;
+	for (int i = 0; i < HIST; i++) {
+		seen += hist[i];
+		if (seen > rank)
+			return hist_value(i);
+	}
+	return hist_value(HIST - 1);
+}
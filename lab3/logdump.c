@@ -0,0 +1,148 @@
+/*
+ * logdump.c - prints the chat log that server -L writes, see chatlog.h
+ * 	     - seeks to -s lsn through the sparse index, then reads the segments in order
+ */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "chatlog.h"
+
+void error_exit(const char* error) {
+	perror(error);
+	exit(-1);
+}
+
+void usage(const char* prog) {
+	fprintf(stderr, "usage: %s -d dir [-s lsn] [-r room]\n", prog);
+	exit(-1);
+}
+
+size_t seg_seek(const char* dir, unsigned long num, uint64_t base, uint64_t lsn);
+void seg_dump(const char* dir, unsigned long num, size_t off, uint64_t from, const char* room);
+
+int main(int argc, char** argv) {
+
+	// getopt()
+	int opt;
+	char *dir = NULL, *room = NULL;
+	uint64_t from = 0;
+	while ((opt = getopt(argc, argv, "d:s:r:")) != -1) {
+		switch(opt){
+			case 'd':
+				dir = optarg;
+				break;
+			case 's':
+				from = strtoull(optarg, NULL, 10);
+				break;
+			case 'r':
+				room = optarg;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (dir == NULL)
+		usage(argv[0]);
+
+	unsigned long* nums;
+	int n = log_list(dir, &nums);
+	if (n == -1)
+		error_exit(dir);
+
+	// the last started segment beginning at or before from
+	int first = 0;
+	uint64_t base;
+	for (int i = n - 1; i > 0; i--)
+		if ((log_base(dir, nums[i], &base) == 0) && (base <= from)) {
+			first = i;
+			break;
+		}
+
+	for (int i = first; i < n; i++) {
+		// a spare the server created ahead
+		if (log_base(dir, nums[i], &base) == -1)
+			continue;
+		size_t off = (i == first) ? seg_seek(dir, nums[i], base, from) : LOG_SEG_HDR;
+		seg_dump(dir, nums[i], off, from, room);
+	}
+	free(nums);
+	return 0;
+}
+
+/*
+ * seg_seek - offset of the indexed record at or before lsn
+ * @param dir - the log directory
+ * @param num - the segment
+ * @param base - its first lsn
+ * @param lsn - the lsn looked for
+ * @returns the offset, LOG_SEG_HDR without an index
+ */
+size_t seg_seek(const char* dir, unsigned long num, uint64_t base, uint64_t lsn) {
+	char path[PATH_MAX];
+	uint32_t slot;
+	if (lsn <= base)
+		return LOG_SEG_HDR;
+
+	log_path(path, sizeof(path), dir, num, "idx");
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return LOG_SEG_HDR;
+	// slots not written yet are 0, go back to one that was
+	long i = (lsn - base) / LOG_INDEX_EVERY;
+	if (i >= LOG_INDEX_SLOTS)
+		i = LOG_INDEX_SLOTS - 1;
+	for (; i >= 0; i--)
+		if ((pread(fd, &slot, sizeof(slot), i * sizeof(slot)) == sizeof(slot)) && (slot != 0)) {
+			close(fd);
+			return slot - 1;
+		}
+	close(fd);
+	return LOG_SEG_HDR;
+}
+
+/*
+ * seg_dump - print the records of a segment, one line each: lsn room #seq text
+ * @param dir - the log directory
+ * @param num - the segment
+ * @param off - offset of the first record to look at
+ * @param from - lsns below it are skipped
+ * @param room - only this room, NULL for all
+ */
+void seg_dump(const char* dir, unsigned long num, size_t off, uint64_t from, const char* room) {
+	char path[PATH_MAX];
+	struct stat st;
+	log_path(path, sizeof(path), dir, num, "log");
+	int fd = open(path, O_RDONLY);
+	if ((fd == -1) || (fstat(fd, &st) == -1))
+		error_exit(path);
+	char* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		error_exit("mmap");
+
+	const struct log_rec* r;
+	while ((r = log_next(map, st.st_size, &off)) != NULL) {
+		struct frame f;
+		if (r->lsn < from)
+			continue;
+		if (room && ((strlen(room) != r->namelen) || (memcmp(room, r->data, r->namelen) != 0)))
+			continue;
+		const char* frame = r->data + r->namelen;
+		if (frame_decode(frame, r->len - LOG_REC_HDR - r->namelen, &f) <= 0)
+			continue;
+		int len = f.len;
+		// one line per message
+		while ((len > 0) && (frame[FRAME_HDR + len - 1] == '\n'))
+			len--;
+		printf("%lu %.*s #%lu %.*s\n", (unsigned long) r->lsn, (int) r->namelen, r->data,
+		       (unsigned long) f.seq, len, frame + FRAME_HDR);
+	}
+	munmap(map, st.st_size);
+	close(fd);
+}
@@ -1,43 +1,644 @@
 /*
  * server.c - a chat server (and monitor) that uses pipes and sockets
+ * 	    - gcc -pthread, clients are spread across -t reactor threads
+ * 	    - epoll, or io_uring with -u
  */
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <netinet/in.h>
 #include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include "chatlog.h"
+#include "frame.h"
+#include "uring.h"
+#include "wheel.h"
 
 // constants for pipe FDs
 #define WFD 1
 #define RFD 0
 
-// maximum number of clients
-#define MAX_CLIENT 10
+// default maximum number of clients, -c
+#define MAX_CLIENT 4096
+
+// connections are allocated in slabs that never move,
+// so epoll_event.data.ptr stays valid while the table grows
+#define CONN_SLAB 256
+
+// sent in a FRAME_FULL to a client turned away because the table is full
+#define FULL_MSG "server full, try again later\n"
+
+// maximum number of events returned by one epoll_wait()
+#define MAX_EVENTS 64
+
+// default bytes queued for one client before it is cut off, -q
+#define HIGH_WATER (1 << 20)
+
+// bytes of one message buffer, consecutive recv()s fill it back to back
+#define MSG_SIZE 16384
+
+// a fresh buffer is taken once less than this is left in the current one
+#define MSG_MIN 1024
+
+_Static_assert(MSG_SIZE >= FRAME_HDR + FRAME_MAX, "a frame must fit in one msg");
+_Static_assert(MSG_MIN > FRAME_HDR, "the monitor frames what it reads into rx");
+
+// most queued messages handed to one writev()
+#define FLUSH_IOV 64
+
+// most reactor threads, -t
+#define MAX_SHARDS 64
+
+// most endpoints listened on, -l
+#define MAX_LISTEN 8
+
+// slots in the mailbox from one shard to another, a power of 2
+#define MAILBOX_SIZE 1024
+
+// most rooms, ids are never reused, and longest room name
+#define MAX_ROOMS 1024
+#define ROOM_NAME 32
+
+// slots of the room name hash, a power of 2 above MAX_ROOMS
+#define ROOM_HASH 2048
+
+// messages a room's history keeps, a power of 2, and the largest frame it keeps,
+// as long as anything lab3/client.c sends
+#define HIST_SLOTS 64
+#define HIST_FRAME (FRAME_HDR + 1024)
+
+// a tick of the timing wheel, in ns
+#define TICK_NS 1000000
+
+// seconds a client may stay quiet before it is pinged, and again before it is hung up on
+#define IDLE_TIMEOUT 60
+
+// the log flusher's group commit, one fdatasync() per segment at most this often
+#define LOG_SYNC_MS 10
+
+// slots of the monitor feed, a power of 2, and the bytes of a message one holds
+#define MON_SLOTS 1024
+#define MON_TEXT 496
+
+// every client starts in room 0
+#define LOBBY "lobby"
+
+// broadcast() to every client of the shard, not one room
+#define ROOM_ALL -1
+
+// -H, what a server hands over to the one taking its place, see handoff_serve()
+#define HANDOFF_MAGIC "chatho03"
+// bytes of one message of a byte string on the handoff socket
+#define HANDOFF_CHUNK 65536
+
+// io_uring backend: SQ entries, and provided recv buffers per shard and their size
+#define UR_ENTRIES 1024
+#define UBUF_COUNT 4096
+#define UBUF_SIZE 2048
+
+// what a CQE completes, in the low bits of user_data next to the conn pointer
+enum ur_op { UR_ACCEPT, UR_RECV, UR_SEND, UR_POLL, UR_TIMEOUT, UR_CANCEL };
+#define UR_OP_MASK 7
+
+struct conn_table;
+
+// a received message, stored once and shared by every receiver's queue
+struct msg {
+	// references from output queues, mailboxes and conn_table.rx,
+	// dropped by whichever shard sent the bytes
+	atomic_int refs;
+	// bytes filled so far, written by the owner only
+	int len;
+	// pool the msg goes back to, the table of the shard that received it
+	struct conn_table* owner;
+	// next free msg while in a pool
+	struct msg* next_free;
+	// id in the provided buffer ring of the io_uring backend, -1 for pool msgs
+	int bid;
+	// MSG_SIZE bytes, UBUF_SIZE for provided buffers
+	char data[];
+};
+
+// a reference to part of a shared message, queued for one client
+struct msgref {
+	struct msg* m;
+	int off, len;
+};
+
+// what an fd in the epoll set is
+enum conn_kind { CONN_LISTEN, CONN_MONITOR, CONN_DOORBELL, CONN_CLIENT };
+
+// what a client's wheel_node is armed for
+enum conn_timer { TIMER_THROTTLE, TIMER_IDLE };
+
+// per-fd state, epoll_event.data.ptr points here
+struct conn {
+	enum conn_kind kind;
+	int fd;
+	// index in conn_table.live while connected
+	int live_i;
+	// next free conn while on the free or closed list
+	struct conn* next_free;
+	// unsent output, a ring of references flushed with writev()
+	struct msgref* outq;
+	unsigned out_head, out_count, out_cap;
+	size_t out_bytes;
+	// queued since the last flush, on conn_table.pending
+	int pending;
+	struct conn* next_pending;
+	// messages dropped because the queue was over the high-water mark
+	long drops;
+	// io_uring requests in flight, the conn is not reused until they complete
+	int ops;
+	// queued messages in the SENDMSG in flight, sent from us
+	int send_refs;
+	struct usend* us;
+	// multishot recv stopped for lack of provided buffers, on ureactor.starved
+	struct conn* next_starved;
+	// a frame received in part, from part_off up to part->len
+	struct msg* part;
+	int part_off;
+	// room the client is in, and its index in the room's members
+	int room, room_i;
+	// -R, when its next message is due, as far past now as it is in debt
+	uint64_t tat;
+	// frames taken from it, what a FRAME_ACK answers with
+	uint64_t frames;
+	// sent EOF, out of its room and not read, closed once its queue is sent
+	int closing;
+	// over its rate or its room's, not read until timer fires
+	int throttled;
+	struct wheel_node timer;
+	// a multishot recv is armed, or waits on ureactor.starved
+	int reading;
+	// io_uring, bytes received while throttled, copied in order, linked through next_free
+	struct msg *held, *held_tail;
+	// -I, ticks of the last bytes received, of output last taken by the socket
+	// or queued behind none, and of the last PING sent
+	uint64_t last_in, last_out, pinged;
+	struct wheel_node idle;
+};
+
+// arguments of a conn's SENDMSG, stable until it completes
+struct usend {
+	struct msghdr mh;
+	struct iovec iov[FLUSH_IOV];
+};
+
+// the clients of one shard in one room, compact for broadcast()
+struct members {
+	struct conn** c;
+	int n, cap;
+};
+
+// counters of one shard, -m, written by the shard alone with a relaxed load and store,
+// no locked instruction, read by the metrics thread whenever it is scraped
+struct shard_stats {
+	// gauges, clients connected, bytes queued for them, mail waiting for a full mailbox
+	_Atomic uint64_t conns, queued, backlog;
+	_Atomic uint64_t accepted, closed;
+	// hung up on for falling behind, for going quiet or leaving output unread (-I)
+	_Atomic uint64_t slow_closed, idle_closed;
+	// frames from clients, bytes received
+	_Atomic uint64_t frames_in, bytes_in;
+	// messages queued for clients, bytes their sockets took
+	_Atomic uint64_t frames_out, bytes_out;
+	// messages dropped for clients over the high-water mark (-D)
+	_Atomic uint64_t drops;
+	// times a client went over its rate or its room's (-R, -M)
+	_Atomic uint64_t throttled;
+	// broadcasts to a room, one per message per shard it reaches
+	_Atomic uint64_t broadcasts;
+	// recv, writev, accept, eventfd, epoll_wait or io_uring_enter
+	_Atomic uint64_t syscalls;
+};
+
+// add n to a counter of the calling shard's stats
+#define STAT_ADD(st, field, n) atomic_store_explicit(&(st)->field, \
+	atomic_load_explicit(&(st)->field, memory_order_relaxed) + (n), memory_order_relaxed)
+
+// growable connection table, O(1) insert and remove
+struct conn_table {
+	// index of the shard it belongs to
+	int id;
+	// slabs of CONN_SLAB conns
+	struct conn** slabs;
+	int nslabs, maxslabs;
+	// free conns, linked through next_free
+	struct conn* free;
+	// conns closed during this epoll_wait() batch, events may still point
+	// at them, they go back on the free list once the batch is done
+	struct conn* closed;
+	// dense array of connected clients
+	struct conn** live;
+	int nlive, maxlive;
+	// members[room], the clients of this shard in each room
+	struct members* members;
+	// clients with output queued during this batch, flushed once it is done
+	struct conn* pending;
+	// free message buffers
+	struct msg* pool;
+	// msgs of this table released by other shards, a lock-free stack
+	// taken whole by msg_get() when the pool runs dry
+	struct msg* _Atomic remote_free;
+	// buffer the next recv() fills
+	struct msg* rx;
+	// kept open so a client can be accepted and turned away when out of fds
+	int spare_fd;
+	// io_uring backend, NULL with epoll
+	struct ureactor* ur;
+	// CLOCK_MONOTONIC ns, read once per batch
+	uint64_t now;
+	// timers of the shard's clients, ticks of TICK_NS
+	struct wheel wheel;
+	// on its own cache line, scraped by the metrics thread
+	_Alignas(64) struct shard_stats stats;
+};
+
+// a shard's io_uring, and the msgs its recvs land in
+struct ureactor {
+	struct uring ring;
+	struct uring_bufs bufs;
+	// bufmsgs[bid] holds the provided buffer bid
+	struct msg** bufmsgs;
+	// buffers returned since the ring was last committed
+	int recycled;
+	// conns waiting for provided buffers to rearm their recv
+	struct conn* starved;
+	// an IORING_OP_TIMEOUT is pending, for backlogged mail or the wheel, due at timer_at
+	int timer;
+	uint64_t timer_at;
+	struct __kernel_timespec tick;
+};
+
+// command-line options, set once in main()
+struct options {
+	// maximum number of concurrent clients, -c
+	int max_client;
+	// bytes queued for one client before it falls too far behind, -q
+	size_t high_water;
+	// drop messages for a client over high_water instead of disconnecting it, -D
+	int drop_slow;
+	// reactor threads, -t
+	int threads;
+	// io_uring backend instead of epoll, -u
+	int uring;
+	// directory of the chat log, NULL for none, -L
+	char* log_dir;
+	// ns between the messages of one client, -R, and of one room, -M, 0 for no limit,
+	// each may send a second's worth in a burst
+	uint64_t rate_ns, room_rate_ns;
+	// ticks a client may stay quiet, or leave its output unread, -I, 0 for ever
+	uint64_t idle_ticks;
+	// where the metrics are served, a loopback port or unix:path, NULL for nowhere, -m
+	char* metrics;
+	// unix socket the server hands over on and its successor takes over from, -H
+	char* handoff;
+	// endpoints listened on, see connect_wait(), none for any IPv4 address on -p, -l
+	char* listen[MAX_LISTEN];
+	int nlisten;
+};
+struct options opts = { MAX_CLIENT, HIGH_WATER, 0, 1, 0, NULL, 0, 0, IDLE_TIMEOUT * (1000000000 / TICK_NS), NULL, NULL, { NULL }, 0 };
+
+// a message posted to another shard, which broadcasts it to its own clients in room
+struct mail {
+	struct msg* m;
+	int off, len;
+	int room;
+};
+
+// single-producer single-consumer ring from one shard to another
+struct mailbox {
+	// next slot the consumer reads, on its own cache line
+	_Alignas(64) atomic_uint head;
+	// next slot the producer writes
+	_Alignas(64) atomic_uint tail;
+	struct mail slots[MAILBOX_SIZE];
+};
+
+// mail for a full mailbox, kept by the sender and retried after every batch
+struct backlog {
+	struct mail* q;
+	int n, cap;
+};
+
+// a reactor thread, its epoll instance and the clients it accepted
+struct shard {
+	int id;
+	pthread_t tid;
+	int epfd;
+	// a listener per endpoint, TCP ones SO_REUSEPORT so the kernel spreads new
+	// connections across shards, a unix one is the same socket in every shard
+	int nlisten;
+	struct conn listeners[MAX_LISTEN];
+	// eventfd rung by other shards after posting mail
+	int evfd;
+	struct conn doorbell;
+	struct conn_table table;
+	// inbox[src], written by shard src only
+	struct mailbox* inbox;
+	// mail that did not fit in shards[dst].inbox[id], backlog[dst]
+	struct backlog* backlog;
+	// shards posted to during this batch, rung once it is done
+	uint64_t rung;
+	// fed the monitor during this batch, it is rung once it is done if asleep
+	int mon_due;
+	// -H, its clients are no longer read, and it told the handoff thread it is quiet
+	int stopped, quiet;
+};
+
+// one message of a room's history, a seqlock
+struct hist_slot {
+	// odd while a shard writes the slot, readers retry or skip it
+	atomic_uint ver;
+	int len;
+	uint64_t seq;
+	char frame[HIST_FRAME];
+};
+
+// the last HIST_SLOTS messages of a room, written by any shard with members, read without locks
+struct history {
+	// seq of the last message numbered, 0 before the first
+	_Alignas(64) _Atomic uint64_t seq;
+	struct hist_slot slots[HIST_SLOTS];
+};
+
+// a chat room, shared by every shard
+struct room {
+	char name[ROOM_NAME];
+	// bit i set while shard i has members, messages are only posted to those
+	_Atomic uint64_t shards;
+	// allocated with the room, never freed
+	struct history* hist;
+	// -M, when its next message is due, shared by the shards of its members
+	_Atomic uint64_t tat;
+};
+
+// state shared by every shard
+struct relay {
+	struct shard* shards;
+	int nshards;
+	// clients connected across all shards, at most opts.max_client
+	atomic_int nclients;
+	// monitor pipes, mrfd read by shard 0, mwfd only rings the monitor, see struct mon_feed
+	int mrfd, mwfd;
+	struct conn monitor;
+	// rooms[id], never moved, created under rooms_lock and never removed
+	struct room rooms[MAX_ROOMS];
+	int nrooms;
+	// room ids + 1 by name, open addressing, 0 is empty
+	int room_hash[ROOM_HASH];
+	pthread_mutex_t rooms_lock;
+	// -H, 1 while the shards stop reading clients, 2 while they drain and park,
+	// the shards that are quiet and parked so far
+	atomic_int handoff, quiet, parked;
+	// the monitor, stopped with the server it belongs to when it hands over
+	pid_t monitor_pid;
+	// the metrics listener, closed when handing over
+	int metrics_fd;
+};
+struct relay relay = { .rooms_lock = PTHREAD_MUTEX_INITIALIZER };
+
+// a client message on its way to the monitor
+struct mon_slot {
+	// pos while free for the producer of position pos, pos + 1 once written
+	atomic_ulong seq;
+	// bytes held, and bytes the message had
+	int len, full;
+	char text[MON_TEXT];
+};
+
+// the clients' messages for the monitor, mapped shared before fork()
+// - a bounded multi-producer ring, a message that finds it full is dropped and counted,
+//   so a slow terminal never holds up a shard
+struct mon_feed {
+	// next position a shard claims
+	_Alignas(64) atomic_ulong tail;
+	// messages dropped so far, the monitor reports new drops
+	_Alignas(64) atomic_ulong dropped;
+	// set by the monitor before it waits on the pipe, cleared by the shard that rings it
+	atomic_int sleeping;
+	// next position the monitor reads, the monitor's own
+	_Alignas(64) unsigned long head;
+	struct mon_slot slots[MON_SLOTS];
+};
+struct mon_feed* feed;
+
+// a mapped segment of the chat log, see chatlog.h
+// - never freed, a shard may still hold it after the rollover, only the mappings are released
+struct log_seg {
+	unsigned long num;
+	uint64_t base;
+	int fd, ifd;
+	char* map;
+	uint32_t* index;
+	// records << 32 | bytes reserved, one fetch_add claims an lsn and the room for its record
+	_Alignas(64) _Atomic uint64_t tail;
+	// bytes of records written, the segment is complete once that reaches end
+	_Alignas(64) _Atomic uint64_t filled;
+	uint64_t end;
+	// filled at the last fdatasync(), the flusher's own
+	uint64_t synced;
+	struct log_seg* next_retired;
+};
+
+// the chat log, -L
+struct chatlog {
+	// segment being appended to
+	struct log_seg* _Atomic cur;
+	// the rollover, and the segments it moves between the shards and the flusher
+	pthread_mutex_t roll;
+	// rolled over, closed by the flusher once their writers are done
+	struct log_seg* retired;
+	// created ahead by the flusher, for the next rollover
+	struct log_seg* spare;
+	// number of the last segment created
+	unsigned long last;
+	pthread_t flusher;
+};
+struct chatlog chatlog = { .roll = PTHREAD_MUTEX_INITIALIZER };
+
+// the messages on the handoff socket, SOCK_SEQPACKET, in this order:
+// a handoff_hdr, then a message per shard with its listeners attached, SCM_RIGHTS
+// a handoff_room per room, by id, each followed by the frames of its history
+// a handoff_conn per client with its socket attached, each followed by its unrelayed
+// input and unsent output, byte strings in messages of up to HANDOFF_CHUNK
+struct handoff_hdr {
+	char magic[8];
+	int nshards, nlisten, nrooms, nconns;
+};
+
+struct handoff_room {
+	char name[ROOM_NAME];
+	// last seq numbered, -M due time
+	uint64_t seq, tat;
+	// bytes of its history's frames, in seq order
+	uint32_t histlen;
+};
+
+struct handoff_conn {
+	int room;
+	long drops;
+	// -R due time, CLOCK_MONOTONIC is the same in both processes
+	uint64_t tat;
+	// frames taken, its FRAME_ACKs go on counting
+	uint64_t frames;
+	// bytes received and not relayed yet, bytes queued and not sent yet
+	uint32_t inlen, outlen;
+};
+
+// a byte string on its way out, sent HANDOFF_CHUNK at a time
+struct handoff_out {
+	int fd, len;
+	char buf[HANDOFF_CHUNK];
+};
 
 // exit on error
 void error_exit(const char* error);
 
 // FOR SERVER()
 // sends message to all clients
-void broadcast(int receiver, int sender, int socketFD, int recv_bytes, const char* recv_buf, fd_set* OGFDs);
+void broadcast(struct conn_table* table, struct conn* sender, int room, struct msg* m, int off, int len);
+
+// sends & receives message, remove client from the table on EOF
+void send_recv(struct shard* sh, struct conn* client);
+
+// split received bytes into frames and relay them
+void conn_input(struct shard* sh, struct conn* c, struct msg* m, int off);
+void frame_relay(struct shard* sh, struct conn* c, struct msg* m, int off, struct frame* f);
+void conn_feed(struct shard* sh, struct conn* c, struct msg* m, int off);
+void conn_hold(struct conn_table* table, struct conn* c, const char* buf, int len);
+void conn_resume(struct shard* sh, struct conn* c);
+
+// rooms
+int room_find(const char* name, int len);
+void room_join(struct conn_table* table, struct conn* c, int room);
+void room_leave(struct conn_table* table, struct conn* c);
+void conn_notice(struct conn_table* table, struct conn* c, const char* text);
+
+// rate limits, token buckets as GCRA, one due time each
+void rate_charge(struct conn_table* table, struct conn* c);
+int conn_throttle(struct conn_table* table, struct conn* c);
+void shard_timers(struct shard* sh);
+uint64_t now_ns(void);
 
-// sends & receives message, remove client from readFDs on EOF
-void send_recv(int client, int mrfd, int mwfd, fd_set* OGFDs, int clientFDs[], int socketFD, int* fdmax, int* clientNum, int clientInd);
+// heartbeats, -I
+void conn_heartbeat(struct conn_table* table, struct conn* c);
+void conn_control(struct conn_table* table, struct conn* c, int type);
+
+// room history
+void history_add(struct history* h, char* frame, int len);
+void history_replay(struct conn_table* table, struct conn* c, struct history* h, uint64_t after);
+
+// chat log
+void log_init(void);
+void log_append(const char* room, const char* frame, int len);
+void log_roll(struct log_seg* seg, uint64_t end, uint64_t records);
+struct log_seg* log_create(unsigned long num);
+void log_start(struct log_seg* seg, uint64_t base);
+void log_close(struct log_seg* seg);
+void* log_flush(void* arg);
+
+// hot restart, -H
+int handoff_connect(void);
+void handoff_begin(int fd, struct handoff_hdr* hh, int listeners[][MAX_LISTEN]);
+void handoff_adopt(int fd, struct handoff_hdr* hh);
+void handoff_listen(void);
+void* handoff_serve(void* arg);
+void handoff_send(int fd, const void* buf, int len, const int* fds, int nfds);
+int handoff_recv(int fd, void* buf, int len, int* fds, int maxfds);
+void handoff_put(struct handoff_out* o, const void* buf, size_t len);
+void handoff_flush(struct handoff_out* o);
+void handoff_take(int fd, char* buf, size_t len);
+void shard_handoff(struct shard* sh);
+void shard_adopted(struct shard* sh);
+
+// metrics, -m
+void metrics_init(void);
+void* metrics_serve(void* arg);
+void metrics_write(FILE* out);
 
 // wait for connection
-void connect_wait(int* socketFD, struct sockaddr_in* serv_addr, int port);
+void connect_wait(int* socketFD, const char* endpoint, int port);
+
+// accept connections, add new fds to the epoll set and the table
+void connect_accept(struct shard* sh, struct conn* l);
+void conn_admit(struct shard* sh, int fd);
+void conn_refuse(int fd);
+
+// broadcast what the monitor typed, feed clients' messages to it
+void monitor_recv(struct shard* sh);
+void monitor_write(struct shard* sh, const char* buf, int len);
+void monitor_ring(struct shard* sh);
+int monitor_drain(unsigned long* dropped);
+
+// reactor threads
+void shard_init(struct shard* sh, int id, int port, const int* listenfds);
+void* shard_run(void* arg);
+void shard_post(struct shard* sh, int room, struct msg* m, int off, int len);
+int shard_send_mail(struct shard* sh);
+void shard_recv_mail(struct shard* sh);
+
+// io_uring backend
+void* shard_run_uring(void* arg);
+void uring_complete(struct shard* sh, struct io_uring_cqe* cqe);
+void uring_recv(struct conn_table* table, struct conn* c);
+void uring_send(struct conn_table* table, struct conn* c);
+void uring_poll(struct ureactor* ur, struct conn* c);
+void uring_accept(struct ureactor* ur, struct conn* l);
+void uring_cancel(struct ureactor* ur, struct conn* c, int op);
+void uring_timeout(struct ureactor* ur, uint64_t now, int ms);
 
-// accept connections, add new fd to fd_set readFDs, add new client to client list
-void connect_accept(fd_set *OGFDs, int clientFDs[], int* clientNum, int* fdmax, int socketFD);
+// connection table
+void table_init(struct conn_table* table);
+struct conn* conn_alloc(struct conn_table* table, int fd);
+void conn_close(struct conn_table* table, struct conn* c);
+void conn_eof(struct conn_table* table, struct conn* c);
+void table_reap(struct conn_table* table);
+
+// queue output for a client, flush it once the batch is done or the socket drains
+int conn_send(struct conn_table* table, struct conn* c, struct msg* m, int off, int len);
+void conn_flush(struct conn_table* table, struct conn* c);
+void conn_sent(struct conn_table* table, struct conn* c, size_t sent);
+void conn_drop(struct conn_table* table, struct conn* c, unsigned keep);
+void table_flush(struct conn_table* table);
+
+// refcounted message buffers
+struct msg* msg_get(struct conn_table* table);
+void msg_put(struct conn_table* table, struct msg* m, int n);
+void msg_free(struct conn_table* table, struct msg* m);
+void table_reclaim(struct conn_table* table);
+struct msg* rx_buf(struct conn_table* table);
+
+// add fd to the epoll set, edge-triggered
+void watch(int epfd, struct conn* c);
+
+// set O_NONBLOCK
+void set_nonblock(int fd);
 
 /*
  * monitor - provides a local chat window
@@ -47,32 +648,36 @@ void connect_accept(fd_set *OGFDs, int clientFDs[], int* clientNum, int* fdmax,
 void monitor(int srfd, int swfd) {
 
 	fd_set readFDs;
-  	int rbyte, kbyte;
+  	int kbyte;
 	char rbuf[1024], kbuf[1024];
 	// STDIN_FILENO == 0
 	int fdmax = srfd;
+	unsigned long dropped = 0;
 
 	do {
 
-		// select()
+		// display the feed, then say it is about to sleep and look once more,
+		// a message published before the shard saw the flag would not ring
+		int busy = monitor_drain(&dropped);
+		if (!busy) {
+			atomic_store(&feed->sleeping, 1);
+			busy = monitor_drain(&dropped);
+		}
+
+		// select(), just a look at the keyboard while the feed is busy
+		struct timeval tv = {0, 0};
 		FD_ZERO(&readFDs);
 		FD_SET(STDIN_FILENO, &readFDs);
 		FD_SET(srfd, &readFDs);
-		if (select(fdmax + 1, &readFDs, 0, 0, 0) == -1)
+		if (select(fdmax + 1, &readFDs, 0, 0, busy ? &tv : NULL) == -1)
 			error_exit("select monitor");
 
 		for (int i = 0; i <= fdmax; i++) {
 			if (FD_ISSET(i, &readFDs)) {
-				// s2mFDs[RFD] is set
+				// s2mFDs[RFD] is set, rung, the messages are in the feed
 				if (i == srfd) {
-					// read error
-					if ((rbyte = read(srfd, rbuf, 1024)) < 0)
+					if (read(srfd, rbuf, sizeof(rbuf)) < 0)
 						error_exit("s2m read");
-					else {
-					// write to display
-						if (write(STDOUT_FILENO, rbuf, rbyte) == -1)
-							error_exit("display monitor");
-					}
 				}
 
 				// STDIN_FILENO is set
@@ -98,279 +703,2950 @@ void monitor(int srfd, int swfd) {
 	} while(1);
 }
 
+/*
+ * monitor_drain - display the messages in the feed and how many were dropped, in one write()
+ * @param dropped - drops reported so far, updated
+ * @returns # of messages displayed
+ */
+int monitor_drain(unsigned long* dropped) {
+	static char out[65536];
+	int olen = 0, n = 0;
+
+	for (;;) {
+		struct mon_slot* s = &feed->slots[feed->head & (MON_SLOTS - 1)];
+		if (atomic_load(&s->seq) != feed->head + 1)
+			break;
+		// room for the text and a note that it was cut
+		if (olen + s->len + 32 > (int) sizeof(out)) {
+			if (write(STDOUT_FILENO, out, olen) == -1)
+				error_exit("display monitor");
+			olen = 0;
+		}
+		memcpy(out + olen, s->text, s->len);
+		olen += s->len;
+		if (s->full > s->len)
+			olen += sprintf(out + olen, "... (%d bytes)\n", s->full);
+		// free for the producer one lap ahead
+		atomic_store_explicit(&s->seq, feed->head + MON_SLOTS, memory_order_release);
+		feed->head++;
+		n++;
+	}
 
+	unsigned long d = atomic_load_explicit(&feed->dropped, memory_order_relaxed);
+	if (d != *dropped) {
+		olen += sprintf(out + olen, "[monitor fell behind, %lu messages dropped]\n", d - *dropped);
+		*dropped = d;
+	}
+	if ((olen > 0) && (write(STDOUT_FILENO, out, olen) == -1))
+		error_exit("display monitor");
+	return n;
+}
 
 /*
  * server - relays chat messages
+ * 	  - runs opts.threads shards, shard 0 on the calling thread
  * @param mrfd - monitor read file descriptor
  * @param mwfd - monitor write file descriptor
  * @param port - TCP port number to use for client connections
  */
 void server(int mrfd, int mwfd, int port) {
+	struct handoff_hdr hh;
+	int hfd = -1, listeners[MAX_SHARDS][MAX_LISTEN];
 
-	struct sockaddr_in serv_addr;
-	int socketFD;
-	memset(&serv_addr, 0, sizeof(serv_addr));
-	connect_wait(&socketFD, &serv_addr, port);
+	// -H, take over from the server running there, its listeners make the shards
+	if (opts.handoff && ((hfd = handoff_connect()) != -1)) {
+		handoff_begin(hfd, &hh, listeners);
+		if ((opts.threads != hh.nshards) || (opts.nlisten && (opts.nlisten != hh.nlisten)))
+			fprintf(stderr, "taking over %d shards of %d listeners, -t and -l ignored\n", hh.nshards, hh.nlisten);
+		opts.threads = hh.nshards;
+		opts.nlisten = hh.nlisten;
+	}
+	// any IPv4 address on port
+	if (opts.nlisten == 0)
+		opts.listen[opts.nlisten++] = NULL;
+
+	relay.nshards = opts.threads;
+	relay.mrfd = mrfd;
+	relay.mwfd = mwfd;
+	// the doorbell never blocks a shard
+	set_nonblock(mwfd);
+	if ((relay.shards = calloc(relay.nshards, sizeof(struct shard))) == NULL)
+		error_exit("calloc shards");
+
+	// room 0, where every client starts
+	room_find(LOBBY, strlen(LOBBY));
+
+	// each shard makes its own ring, see if the kernel allows one at all
+	if (opts.uring) {
+		struct uring probe;
+		int err = uring_init(&probe, 8);
+		if (err < 0) {
+			fprintf(stderr, "io_uring unavailable (%s), using epoll\n", strerror(-err));
+			opts.uring = 0;
+		}
+		else
+			uring_exit(&probe);
+	}
+
+	// every listener is bound before any thread runs
+	for (int i = 0; i < relay.nshards; i++)
+		shard_init(&relay.shards[i], i, port, (hfd != -1) ? listeners[i] : NULL);
+
+	// rooms and clients, once the server before is done with the log and the metrics port
+	if (hfd != -1)
+		handoff_adopt(hfd, &hh);
+	if (opts.log_dir)
+		log_init();
+	if (opts.metrics)
+		metrics_init();
+	if (opts.handoff)
+		handoff_listen();
+
+	// only shard 0 reads the monitor
+	relay.monitor.kind = CONN_MONITOR;
+	relay.monitor.fd = mrfd;
+	set_nonblock(mrfd);
+	if (!opts.uring)
+		watch(relay.shards[0].epfd, &relay.monitor);
+
+	void* (*run)(void*) = opts.uring ? shard_run_uring : shard_run;
+	for (int i = 1; i < relay.nshards; i++)
+		if ((errno = pthread_create(&relay.shards[i].tid, NULL, run, &relay.shards[i])) != 0)
+			error_exit("pthread_create");
+	run(&relay.shards[0]);
+}
+
+/*
+ * shard_init - make a shard's listeners, epoll instance, doorbell and mailboxes
+ * @param sh - the shard
+ * @param id - its index in relay.shards
+ * @param port - TCP port number to use for client connections
+ * @param listenfds - a listener per endpoint taken over with -H, NULL to make them
+ */
+void shard_init(struct shard* sh, int id, int port, const int* listenfds) {
+	sh->id = id;
+	sh->nlisten = opts.nlisten;
+	for (int i = 0; i < sh->nlisten; i++) {
+		struct conn* l = &sh->listeners[i];
+		l->kind = CONN_LISTEN;
+		if (listenfds)
+			l->fd = listenfds[i];
+		// a unix socket cannot be bound twice, the shards wait on the first one's
+		else if ((id > 0) && opts.listen[i] && (strncmp(opts.listen[i], "unix:", 5) == 0))
+			l->fd = relay.shards[0].listeners[i].fd;
+		else
+			connect_wait(&l->fd, opts.listen[i], port);
+	}
+	table_init(&sh->table);
+	sh->table.id = id;
+
+	if ((sh->evfd = eventfd(0, EFD_NONBLOCK)) == -1)
+		error_exit("eventfd");
+	sh->doorbell.kind = CONN_DOORBELL;
+	sh->doorbell.fd = sh->evfd;
 
-	int rbyte, cbyte;
-	char rbuf[1024], cbuf[1024];
+	// edge-triggered: every ready fd is drained until EAGAIN,
+	// the io_uring backend arms its requests in shard_run_uring()
+	if (!opts.uring) {
+		if ((sh->epfd = epoll_create1(0)) == -1)
+			error_exit("epoll_create1");
+		for (int i = 0; i < sh->nlisten; i++)
+			watch(sh->epfd, &sh->listeners[i]);
+		watch(sh->epfd, &sh->doorbell);
+	}
+
+	if ((sh->inbox = aligned_alloc(64, relay.nshards * sizeof(struct mailbox))) == NULL)
+		error_exit("aligned_alloc inbox");
+	memset(sh->inbox, 0, relay.nshards * sizeof(struct mailbox));
+	if ((sh->backlog = calloc(relay.nshards, sizeof(struct backlog))) == NULL)
+		error_exit("calloc backlog");
+}
 
-	int clientFDs[MAX_CLIENT] = {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1};
-	int clientNum = 0;
+/*
+ * shard_run - event loop of one reactor thread
+ * @param arg - the shard
+ */
+void* shard_run(void* arg) {
+	struct shard* sh = arg;
+	struct conn_table* table = &sh->table;
+	struct epoll_event events[MAX_EVENTS];
+	int nready, timeout = -1;
 
-	fd_set OGFDs, readFDs;
-	FD_ZERO(&OGFDs);
-	int fdmax = (mrfd > socketFD) ? mwfd : socketFD;
+	shard_adopted(sh);
 
 	// do until the monitor sends EOF
 	do {
-		// reset readFDs
-		FD_ZERO(&readFDs);
-		readFDs = OGFDs;
-		FD_SET(mrfd, &readFDs);
-		FD_SET(socketFD, &readFDs);
+		// no timeout unless mail is waiting for room in a full mailbox or a timer is armed
+		STAT_ADD(&table->stats, syscalls, 1);
+		if ((nready = epoll_wait(sh->epfd, events, MAX_EVENTS, timeout)) == -1) {
+			if (errno == EINTR)
+				continue;
+			error_exit("epoll_wait server");
+		}
+		table->now = now_ns();
 
-		struct timeval tv;
-		tv.tv_sec = 0;
-		// 0.1 second
-		tv.tv_usec = 100000;
-		if (select(fdmax + 1, &readFDs, 0, 0, &tv) == -1)
-			error_exit("select server");
+		for (int i = 0; i < nready; i++) {
+			struct conn* c = events[i].data.ptr;
 
-		for (int i = 0; i <= fdmax; i++) {
-			if (FD_ISSET(i, &readFDs)) {
-				// socketFD is set
-				if (i == socketFD) {
-					if (clientNum < MAX_CLIENT)
-						connect_accept(&OGFDs, clientFDs, &clientNum, &fdmax, socketFD);
-				}
-				// m2sFDs[RFD] is set
-				if (i == mrfd) {
-					if ((rbyte = read(mrfd, rbuf, 1024)) <= 0) {
-						// error
-						if (rbyte < 0)
-							error_exit("read from monitor server");
-						// rbyte == 0, EOF
-						else {
-							close(socketFD);
-							write(STDOUT_FILENO, "hanging up\n", 12);
-							exit(0);
-						}
-					}
-					// rbyte > 0
-					else {
-						for (int i = 0; i < MAX_CLIENT; i++)
-							broadcast(clientFDs[i], socketFD, socketFD, rbyte, rbuf, &OGFDs);
-					}
+			// closed earlier in this batch
+			if (c->fd == -1)
+				continue;
 
-				}
+			switch (c->kind) {
+				// a listener is ready, left to the successor while handing over
+				case CONN_LISTEN:
+					if (!sh->stopped)
+						connect_accept(sh, c);
+					break;
 
-				// is it one of the clients?
-				for (int j = 0; j <MAX_CLIENT; j++) {
-						if (i == clientFDs[j])
-							send_recv(i, mrfd, mwfd, &OGFDs, clientFDs, socketFD, &fdmax, &clientNum, j);
-				}
+				// another shard posted mail
+				case CONN_DOORBELL:
+					shard_recv_mail(sh);
+					break;
 
+				// m2sFDs[RFD] is ready, shard 0 only
+				case CONN_MONITOR:
+					if (!sh->stopped)
+						monitor_recv(sh);
+					break;
+
+				// one of the clients
+				case CONN_CLIENT:
+					if (events[i].events & EPOLLOUT)
+						conn_flush(table, c);
+					if ((c->fd != -1) && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+						send_recv(sh, c);
+					break;
 			}
 		}
 
+		// clients due to be read again
+		shard_timers(sh);
+
+		// one writev() per client for everything queued during the batch
+		table_flush(table);
+
+		// one doorbell per shard posted to during the batch,
+		// come back in 1ms for backlogged mail, or when the next timer is due
+		timeout = shard_send_mail(sh) ? 1 : wheel_next(&table->wheel);
+		monitor_ring(sh);
+
+		// no event of this batch refers to the closed conns anymore
+		table_reap(table);
+
+		// -H, a successor is taking over
+		if (atomic_load_explicit(&relay.handoff, memory_order_acquire))
+			shard_handoff(sh);
+
 	} while(1);
 
+	return NULL;
 }
 
-int main(int argc, char **argv) {
+/*
+ * shard_run_uring - event loop of one reactor thread on io_uring
+ * 		   - multishot accept and recv, recv into provided buffers that are
+ * 		     broadcast in place, one SENDMSG per client per batch,
+ * 		     everything submitted with the wait, one syscall per batch
+ * @param arg - the shard
+ */
+void* shard_run_uring(void* arg) {
+	struct shard* sh = arg;
+	struct conn_table* table = &sh->table;
+	struct io_uring_cqe* cqe;
+	int err;
 
-	// getopt()
-	int opt, port;
-	while ((opt = getopt(argc, argv, "hp:")) != -1) {
-		switch(opt){
-			case 'p':
-				port = atoi(optarg);
-				break;
-			case 'h':
-				printf("usage: ./server [-h] [-p port#]\n");
-				printf("	-h - this help message\n");
-				printf("	-p # - the port to use when connecting to the server\n");
-				exit(0);
-		}
+	// the ring belongs to the thread that made it, IORING_SETUP_SINGLE_ISSUER
+	struct ureactor* ur = calloc(1, sizeof(struct ureactor));
+	if (ur == NULL)
+		error_exit("calloc ureactor");
+	if (((err = uring_init(&ur->ring, UR_ENTRIES)) < 0) ||
+			((err = uring_bufs_init(&ur->ring, &ur->bufs, UBUF_COUNT, 0)) < 0)) {
+		errno = -err;
+		error_exit("io_uring");
 	}
+	table->ur = ur;
 
-	// for server, s2mFDs[WFD] & m2sFDs[RFD]
-	// for monitor, s2mFDs[RFD] & m2sFDs[WFD]
-	int s2mFDs[2], m2sFDs[2];
+	// provided buffers are msgs too, so receivers queue references to them
+	if ((ur->bufmsgs = malloc(UBUF_COUNT * sizeof(struct msg*))) == NULL)
+		error_exit("malloc bufmsgs");
+	for (int bid = 0; bid < UBUF_COUNT; bid++) {
+		struct msg* m = malloc(sizeof(struct msg) + UBUF_SIZE);
+		if (m == NULL)
+			error_exit("malloc ubuf");
+		m->owner = table;
+		m->bid = bid;
+		ur->bufmsgs[bid] = m;
+		msg_free(table, m);
+	}
+	uring_bufs_commit(&ur->bufs);
+	ur->recycled = 0;
 
-	// pipe
-	if ((pipe(s2mFDs) == -1) || (pipe(m2sFDs) == -1))
-		error_exit("pipe");
+	for (int i = 0; i < sh->nlisten; i++)
+		uring_accept(ur, &sh->listeners[i]);
+	uring_poll(ur, &sh->doorbell);
+	if (sh->id == 0)
+		uring_poll(ur, &relay.monitor);
+	shard_adopted(sh);
 
-	// fork
-	pid_t pid = fork();
-	if (pid < 0) error_exit("fork");
-	else if (pid == 0) {
-		// child
-		close(s2mFDs[WFD]);
-		close(m2sFDs[RFD]);
-		monitor(s2mFDs[RFD], m2sFDs[WFD]);
-		close(s2mFDs[RFD]);
-		close(m2sFDs[WFD]);
-		exit(0);
-	}
-	else {
-		// parent
-		close(m2sFDs[WFD]);
-		close(s2mFDs[RFD]);
-		server(m2sFDs[RFD], s2mFDs[WFD], port);
-		close(m2sFDs[RFD]);
-		close(s2mFDs[WFD]);
-		wait(0);
+	// do until the monitor sends EOF
+	do {
+		STAT_ADD(&table->stats, syscalls, 1);
+		if (((err = uring_enter(&ur->ring, 1)) < 0) && (err != -EINTR)) {
+			errno = -err;
+			error_exit("io_uring_enter");
+		}
+
+		table->now = now_ns();
+		while ((cqe = uring_cqe(&ur->ring)) != NULL) {
+			uring_complete(sh, cqe);
+			uring_cqe_seen(&ur->ring);
+		}
+		shard_timers(sh);
+
+		// buffers released by other shards, then hand the kernel all returned ones
+		table_reclaim(table);
+		if (ur->recycled) {
+			uring_bufs_commit(&ur->bufs);
+			ur->recycled = 0;
+			while (ur->starved) {
+				struct conn* c = ur->starved;
+				ur->starved = c->next_starved;
+				c->ops--;
+				c->reading = 0;
+				if ((c->fd != -1) && !c->throttled)
+					uring_recv(table, c);
+			}
+		}
+
+		// one SENDMSG per client for everything queued during the batch
+		table_flush(table);
+
+		// one doorbell per shard posted to,
+		// come back in 1ms for backlogged mail, or when the next timer is due
+		uring_timeout(ur, table->now, shard_send_mail(sh) ? 1 : wheel_next(&table->wheel));
+		monitor_ring(sh);
+
+		// conns with requests in flight stay on the closed list
+		table_reap(table);
+
+		// -H, a successor is taking over
+		if (atomic_load_explicit(&relay.handoff, memory_order_acquire))
+			shard_handoff(sh);
+
+	} while(1);
+
+	return NULL;
+}
+
+/*
+ * uring_complete - handle one CQE of the io_uring backend
+ * @param sh - the shard
+ * @param cqe - the completion
+ */
+void uring_complete(struct shard* sh, struct io_uring_cqe* cqe) {
+	struct conn_table* table = &sh->table;
+	struct ureactor* ur = table->ur;
+	struct conn* c = (struct conn*) (uintptr_t) (cqe->user_data & ~(uint64_t) UR_OP_MASK);
+	int res = cqe->res, more = cqe->flags & IORING_CQE_F_MORE;
+	struct msg* m;
+
+	switch (cqe->user_data & UR_OP_MASK) {
+		case UR_ACCEPT:
+			if (res >= 0)
+				conn_admit(sh, res);
+			// out of fds, the nonblocking accept() loop turns clients away with the spare fd
+			else if ((res == -EMFILE) || (res == -ENFILE))
+				connect_accept(sh, c);
+			if (!more && !sh->stopped)
+				uring_accept(ur, c);
+			break;
+
+		case UR_POLL:
+			if (c->kind == CONN_DOORBELL)
+				shard_recv_mail(sh);
+			else if (!sh->stopped)
+				monitor_recv(sh);
+			if (!more)
+				uring_poll(ur, c);
+			break;
+
+		case UR_RECV:
+			m = (cqe->flags & IORING_CQE_F_BUFFER) ? ur->bufmsgs[cqe->flags >> IORING_CQE_BUFFER_SHIFT] : NULL;
+			if (!more) {
+				c->ops--;
+				c->reading = 0;
+			}
+
+			// hung up on while the recv was in flight
+			if (c->fd == -1) {
+				if (m)
+					msg_put(table, m, 1);
+				break;
+			}
+
+			if (res > 0) {
+				int throttled = c->throttled;
+				m->len = res;
+				c->last_in = table->now / TICK_NS;
+				STAT_ADD(&table->stats, bytes_in, res);
+				conn_feed(sh, c, m, 0);
+				msg_put(table, m, 1);
+				if (c->fd == -1)
+					break;
+				// over its rate, stop the recv, its timer rearms it
+				if (c->throttled) {
+					if (!throttled && more)
+						uring_cancel(ur, c, UR_RECV);
+				}
+				else if (!more)
+					uring_recv(table, c);
+			}
+			// every buffer is queued somewhere, rearm once some come back
+			else if (res == -ENOBUFS) {
+				if (!more) {
+					c->ops++;
+					c->reading = 1;
+					c->next_starved = ur->starved;
+					ur->starved = c;
+				}
+			}
+			// stopped after conn_throttle(), unless its timer fired meanwhile
+			else if (res == -ECANCELED) {
+				if (!c->throttled)
+					uring_recv(table, c);
+			}
+			// client hung up, or only its side with EOF
+			else if (res == 0)
+				conn_eof(table, c);
+			else
+				conn_close(table, c);
+			break;
+
+		case UR_SEND:
+			c->ops--;
+			// the refs of the messages in flight were left for us
+			if (c->fd == -1) {
+				c->send_refs = 0;
+				conn_drop(table, c, 0);
+				break;
+			}
+			c->send_refs = 0;
+			// stopped by shard_handoff(), nothing was sent, the successor sends it
+			if ((res == -ECANCELED) && sh->stopped)
+				break;
+			if (res < 0) {
+				// the receiver is gone
+				conn_close(table, c);
+				break;
+			}
+			conn_sent(table, c, res);
+			if (c->out_count > 0)
+				uring_send(table, c);
+			else if (c->closing)
+				conn_close(table, c);
+			break;
+
+		case UR_TIMEOUT:
+			ur->timer = 0;
+			break;
+
+		case UR_CANCEL:
+			break;
 	}
+}
 
-	return 0;
+/*
+ * uring_recv - arm a multishot recv into the shard's provided buffers
+ * @param table - the shard's table
+ * @param c - the client
+ */
+void uring_recv(struct conn_table* table, struct conn* c) {
+	struct io_uring_sqe* sqe = uring_sqe(&table->ur->ring);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = c->fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->user_data = (uintptr_t) c | UR_RECV;
+	c->ops++;
+	c->reading = 1;
 }
 
+/*
+ * uring_cancel - stop a request of a conn, it completes with -ECANCELED
+ * @param ur - the shard's ring
+ * @param c - the conn
+ * @param op - UR_RECV, UR_SEND or UR_ACCEPT
+ */
+void uring_cancel(struct ureactor* ur, struct conn* c, int op) {
+	struct io_uring_sqe* sqe = uring_sqe(&ur->ring);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = (uintptr_t) c | op;
+	sqe->user_data = UR_CANCEL;
+}
 
-void error_exit(const char* error) {
-	perror(error);
-	exit(-1);
+/*
+ * uring_timeout - make sure a timeout is pending that expires within ms
+ * @param ur - the shard's ring
+ * @param now - the batch's time
+ * @param ms - ms from now, -1 for none needed
+ */
+void uring_timeout(struct ureactor* ur, uint64_t now, int ms) {
+	uint64_t at = now + (uint64_t) ms * 1000000;
+	if ((ms < 0) || (ur->timer && (ur->timer_at <= at)))
+		return;
+	// read when the SQE is submitted, at the next uring_enter()
+	ur->tick.tv_sec = ms / 1000;
+	ur->tick.tv_nsec = (ms % 1000) * 1000000;
+	struct io_uring_sqe* sqe = uring_sqe(&ur->ring);
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->addr = (uintptr_t) &ur->tick;
+	sqe->len = 1;
+	sqe->user_data = UR_TIMEOUT;
+	ur->timer = 1;
+	ur->timer_at = at;
 }
 
 /*
- * connect_wait - calls listen() and bind()
- * @param socketFD - socketFD made in server()
- * @param serv_addr - holds IP + port
- * @param port - port number
+ * uring_send - submit one SENDMSG for the head of a client's queue
+ * 	      - one at a time per client, the next is submitted when it completes
+ * @param table - the shard's table
+ * @param c - the client
  */
-void connect_wait(int *socketFD, struct sockaddr_in* serv_addr, int port) {
+void uring_send(struct conn_table* table, struct conn* c) {
+	// parking for a successor, it sends the rest
+	if ((c->send_refs > 0) || (c->out_count == 0) || (atomic_load_explicit(&relay.handoff, memory_order_relaxed) == 2))
+		return;
+	if ((c->us == NULL) && ((c->us = calloc(1, sizeof(struct usend))) == NULL))
+		error_exit("calloc usend");
 
-	if ((*socketFD = socket(AF_INET, SOCK_STREAM, 0)) == -1)
-		error_exit("socket");
+	int n = 0;
+	for (unsigned i = 0; (i < c->out_count) && (n < FLUSH_IOV); i++, n++) {
+		struct msgref* r = &c->outq[(c->out_head + i) & (c->out_cap - 1)];
+		c->us->iov[n].iov_base = r->m->data + r->off;
+		c->us->iov[n].iov_len = r->len;
+	}
+	c->us->mh.msg_iov = c->us->iov;
+	c->us->mh.msg_iovlen = n;
+	c->send_refs = n;
 
-	serv_addr->sin_family = AF_INET;
-	serv_addr->sin_addr.s_addr = INADDR_ANY;
-	serv_addr->sin_port = htons(port);
+	struct io_uring_sqe* sqe = uring_sqe(&table->ur->ring);
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = c->fd;
+	sqe->addr = (uintptr_t) &c->us->mh;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = (uintptr_t) c | UR_SEND;
+	c->ops++;
+}
 
-	int val = 1;
-	setsockopt(*socketFD, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val));
+/*
+ * uring_poll - arm a multishot POLLIN, for the doorbell and the monitor pipe
+ * @param ur - the shard's io_uring
+ * @param c - the fd's conn
+ */
+void uring_poll(struct ureactor* ur, struct conn* c) {
+	struct io_uring_sqe* sqe = uring_sqe(&ur->ring);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = c->fd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = (uintptr_t) c | UR_POLL;
+}
 
-	if(bind(*socketFD, (struct sockaddr*) serv_addr, sizeof(struct sockaddr)) == -1)
-		error_exit("bind");
+/*
+ * uring_accept - arm a multishot accept on a listener
+ * @param ur - the shard's io_uring
+ * @param l - the listener
+ */
+void uring_accept(struct ureactor* ur, struct conn* l) {
+	struct io_uring_sqe* sqe = uring_sqe(&ur->ring);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = l->fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = (uintptr_t) l | UR_ACCEPT;
+}
 
-	if(listen(*socketFD, 10) == -1)
-		error_exit("listen");
+/*
+ * monitor_recv - broadcast what the monitor sent as frames to every room, shard 0 only
+ * 		- reads until EAGAIN, exits on EOF
+ * @param sh - shard 0
+ */
+void monitor_recv(struct shard* sh) {
+	struct conn_table* table = &sh->table;
+	struct msg* m;
+	int rbyte;
 
+	// each read() becomes one FRAME_MSG, read in behind room for its header
+	for (;;) {
+		m = rx_buf(table);
+		int room = MSG_SIZE - m->len - FRAME_HDR;
+		if ((rbyte = read(relay.mrfd, m->data + m->len + FRAME_HDR, (room < FRAME_MAX) ? room : FRAME_MAX)) <= 0)
+			break;
+		frame_encode(m->data + m->len, FRAME_MSG, rbyte);
+		broadcast(table, NULL, ROOM_ALL, m, m->len, FRAME_HDR + rbyte);
+		shard_post(sh, ROOM_ALL, m, m->len, FRAME_HDR + rbyte);
+		m->len += FRAME_HDR + rbyte;
+	}
+
+	// rbyte == 0, EOF
+	if (rbyte == 0) {
+		write(STDOUT_FILENO, "hanging up\n", 12);
+		exit(0);
+	}
+	// error
+	if (errno != EAGAIN)
+		error_exit("read from monitor server");
 }
 
 /*
- * connect_accept - accept clients when FD_ISSET(socketFD)
- * 		  - increments clientNum
- * 		  - adds clientFD to OGFDs and clientFDs
- * 		  - update fdmax
- *
- * @param OGFDs - stores file descriptors currently available to read from
- * 		- only used to update readFDs, call select() on readFDs
- * @param clientFDs - list of clients currently in the chat
- * @param clientNum - number of clients currently in the chat
- * @param fdmax - maximum fd value in OGFDs
- * @param socketFD - socket made in server()
- */
-void connect_accept(fd_set *OGFDs, int clientFDs[], int *clientNum, int *fdmax, int socketFD)
-{
-	struct sockaddr_in client_addr;
-	socklen_t addr_size = sizeof(client_addr);
-	int acceptFD;
+ * monitor_write - put a client's message on the monitor feed, or count it dropped if full
+ * 		 - no syscall, the monitor is rung by monitor_ring() after the batch
+ * @param sh - the shard
+ * @param buf - the payload of the message, cut at MON_TEXT bytes
+ * @param len - # of bytes
+ */
+void monitor_write(struct shard* sh, const char* buf, int len) {
+	unsigned long pos = atomic_load_explicit(&feed->tail, memory_order_relaxed);
+	struct mon_slot* s;
 
-	if ((acceptFD = accept(socketFD, (struct sockaddr *)&client_addr, &addr_size)) == -1)
-		error_exit("accept");
-
-	//connect message
-	//printf("Client connected from %s...\n", inet_ntoa(client_addr.sin_addr));
-	// add it to the client FD list
-	FD_SET(acceptFD, OGFDs);
-	// increment clientNum
-	(*clientNum)++;
-	// update fdmax
-	if (acceptFD > *fdmax)
-		*fdmax = acceptFD;
-
-	// add it to the clientFDs array
-	for (int i = 0; i < MAX_CLIENT; i++) {
-		if (clientFDs[i] == -1) {
-			clientFDs[i] = acceptFD;
+	for (;;) {
+		s = &feed->slots[pos & (MON_SLOTS - 1)];
+		long dif = (long) (atomic_load_explicit(&s->seq, memory_order_acquire) - pos);
+		// free, claim it, a failed CAS reloads pos
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak_explicit(&feed->tail, &pos, pos + 1,
+					memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
+		// still holds the message of the last lap, the monitor is behind
+		else if (dif < 0) {
+			atomic_fetch_add_explicit(&feed->dropped, 1, memory_order_relaxed);
 			return;
 		}
+		// another shard claimed it first
+		else
+			pos = atomic_load_explicit(&feed->tail, memory_order_relaxed);
 	}
+
+	s->full = len;
+	s->len = (len < MON_TEXT) ? len : MON_TEXT;
+	memcpy(s->text, buf, s->len);
+	// seq_cst, against the monitor setting sleeping and then finding the slot empty
+	atomic_store(&s->seq, pos + 1);
+	sh->mon_due = 1;
 }
 
 /*
- * send_recv - recv() from the client whose fd is ready to be read from
- *	     - on receiving 0 < bytes, error_exit
- *	     - on receiving 0 byte, remove client from OGFDs & clientFDs, update fdmax
- *	     - send() to other clients in the chat by broadcast()
- * @param client - client FD
- * @param mwfd - s2mFDs[WFD]
- * @param OGFDs - stores FDs currently available to read from
- * @param clientFDs - list of clients currently in the chat
- * @param socketFD - socket fd made in server()
- * @param fdmax - maximum value of fd in OGFDs
- */
-void send_recv(int client, int mrfd, int mwfd, fd_set* OGFDs, int clientFDs[], int socketFD, int* fdmax, int* clientNum, int clientInd) {
-	int recv_bytes;
-	char recv_buf[1024];
-	if ((recv_bytes = recv(client, recv_buf, 1024, 0)) <= 0) {
-		if (recv_bytes < 0) {
-			error_exit("receive send_recv");
-		}
-		else {
-			// client hung up
-			close(client);
-			clientFDs[clientInd] = -1;
-			FD_CLR(client, OGFDs);
-			(*clientNum)--;
-			//printf("The client has disconnected");
-			// update fdmax
-			if (client == *fdmax) {
-				if (*clientNum == 0)
-					*fdmax  = mrfd;
-				else {
-					for (int i = 0; i < MAX_CLIENT; i++) {
-						if (clientFDs[i] > *fdmax)
-							*fdmax = clientFDs[i];
-					}
-				}
+ * monitor_ring - wake the monitor if it sleeps and this batch fed it
+ * @param sh - the shard
+ */
+void monitor_ring(struct shard* sh) {
+	char b = 0;
+	if (!sh->mon_due)
+		return;
+	sh->mon_due = 0;
+	// a full pipe has a wakeup in it already
+	if (atomic_exchange(&feed->sleeping, 0) && (write(relay.mwfd, &b, 1) == -1) && (errno != EAGAIN))
+		error_exit("write swfd doorbell");
+}
+
+/*
+ * shard_post - hand a message to the other shards with clients in the room
+ * 	      - a full mailbox keeps the mail in sh->backlog, in order
+ * @param sh - the shard that received the message
+ * @param room - room it is for, ROOM_ALL for every client
+ * @param m - buffer holding the message, every shard takes a reference
+ * @param off - offset of the message in m
+ * @param len - # of bytes of message received
+ */
+void shard_post(struct shard* sh, int room, struct msg* m, int off, int len) {
+	if (relay.nshards == 1)
+		return;
+
+	uint64_t dsts = (room == ROOM_ALL) ? ~(uint64_t) 0 >> (64 - relay.nshards) :
+		atomic_load_explicit(&relay.rooms[room].shards, memory_order_relaxed);
+	dsts &= ~((uint64_t) 1 << sh->id);
+	if (dsts == 0)
+		return;
+
+	// one atomic add for all of them, the caller's reference keeps m alive
+	atomic_fetch_add_explicit(&m->refs, __builtin_popcountll(dsts), memory_order_relaxed);
+
+	while (dsts) {
+		int dst = __builtin_ctzll(dsts);
+		dsts &= dsts - 1;
+		struct mailbox* mb = &relay.shards[dst].inbox[sh->id];
+		struct backlog* bl = &sh->backlog[dst];
+		unsigned tail = atomic_load_explicit(&mb->tail, memory_order_relaxed);
+
+		// behind earlier mail or no room
+		if ((bl->n > 0) || (tail - atomic_load_explicit(&mb->head, memory_order_acquire) == MAILBOX_SIZE)) {
+			if (bl->n == bl->cap) {
+				bl->cap = bl->cap ? bl->cap * 2 : 64;
+				if ((bl->q = realloc(bl->q, bl->cap * sizeof(struct mail))) == NULL)
+					error_exit("realloc backlog");
 			}
-		}
-	}
-	// there's something to read
-	else {
-		for (int i = 0; i < MAX_CLIENT; i++) {
-			broadcast(clientFDs[i], client, socketFD, recv_bytes, recv_buf, OGFDs);
+			bl->q[bl->n++] = (struct mail) { m, off, len, room };
+			continue;
 		}
 
+		mb->slots[tail & (MAILBOX_SIZE - 1)] = (struct mail) { m, off, len, room };
+		atomic_store_explicit(&mb->tail, tail + 1, memory_order_release);
+		sh->rung |= (uint64_t) 1 << dst;
 	}
-		if (write(mwfd, recv_buf, recv_bytes) == -1)
-		       error_exit("write swfd send_recv");
 }
 
-
 /*
- * broadcast - sends the received message to every client except monitor and the sender
- * @param receiver - a client in clientFds
- * @param sender - the client who sent the message
- * @param socketFD - the monitor socket fd
- * @param recv_bytes - # of bytes of message received
- * @param recv_buf - received message from the sender
- * @param OGFDs - stores fds currently available to read
+ * shard_send_mail - move backlogged mail into mailboxes that have room again,
+ * 		   then ring the doorbell of every shard posted to
+ * @param sh - the sending shard
+ * @returns 1 if mail is still backlogged, 0 otherwise
  */
-void broadcast(int receiver, int sender, int socketFD, int recv_bytes, const char* recv_buf, fd_set* OGFDs){
+int shard_send_mail(struct shard* sh) {
+	int waiting = 0;
+	uint64_t backlog = 0;
+	uint64_t one = 1;
 
-	// is the receiver still in the chat
-	// catch clientFDs[i] == -1
-	if (FD_ISSET(receiver, OGFDs)) {
-		// catch if the receiver is the monitor OR the sender
-		if ((receiver != socketFD) && (receiver != sender)) {
-			if (send(receiver, recv_buf, recv_bytes, 0) == -1)
-				error_exit("send broadcast");
+	for (int dst = 0; dst < relay.nshards; dst++) {
+		struct backlog* bl = &sh->backlog[dst];
+		if (bl->n == 0)
+			continue;
+		struct mailbox* mb = &relay.shards[dst].inbox[sh->id];
+		unsigned tail = atomic_load_explicit(&mb->tail, memory_order_relaxed);
+		unsigned room = MAILBOX_SIZE - (tail - atomic_load_explicit(&mb->head, memory_order_acquire));
+		int k = ((int) room < bl->n) ? (int) room : bl->n;
+
+		for (int i = 0; i < k; i++)
+			mb->slots[(tail + i) & (MAILBOX_SIZE - 1)] = bl->q[i];
+		if (k > 0) {
+			atomic_store_explicit(&mb->tail, tail + k, memory_order_release);
+			memmove(bl->q, bl->q + k, (bl->n - k) * sizeof(struct mail));
+			bl->n -= k;
+			sh->rung |= (uint64_t) 1 << dst;
 		}
+		waiting |= (bl->n > 0);
+		backlog += bl->n;
 	}
+	atomic_store_explicit(&sh->table.stats.backlog, backlog, memory_order_relaxed);
+
+	while (sh->rung) {
+		int dst = __builtin_ctzll(sh->rung);
+		sh->rung &= sh->rung - 1;
+		STAT_ADD(&sh->table.stats, syscalls, 1);
+		if ((write(relay.shards[dst].evfd, &one, sizeof(one)) == -1) && (errno != EAGAIN))
+			error_exit("write eventfd");
+	}
+	return waiting;
+}
+
+/*
+ * shard_recv_mail - broadcast everything other shards posted to this one
+ * @param sh - the receiving shard
+ */
+void shard_recv_mail(struct shard* sh) {
+	uint64_t rung;
+
+	// reset the doorbell first, mail posted after the drain rings it again
+	STAT_ADD(&sh->table.stats, syscalls, 1);
+	if ((read(sh->evfd, &rung, sizeof(rung)) == -1) && (errno != EAGAIN))
+		error_exit("read eventfd");
+
+	for (int src = 0; src < relay.nshards; src++) {
+		struct mailbox* mb = &sh->inbox[src];
+		unsigned head = atomic_load_explicit(&mb->head, memory_order_relaxed);
+		unsigned tail = atomic_load_explicit(&mb->tail, memory_order_acquire);
+		if (head == tail)
+			continue;
+		for (; head != tail; head++) {
+			struct mail* ml = &mb->slots[head & (MAILBOX_SIZE - 1)];
+			// the sender is on another shard
+			broadcast(&sh->table, NULL, ml->room, ml->m, ml->off, ml->len);
+			msg_put(&sh->table, ml->m, 1);
+		}
+		atomic_store_explicit(&mb->head, head, memory_order_release);
+	}
+}
+
+int main(int argc, char **argv) {
+
+	// getopt()
+	int opt, port;
+	while ((opt = getopt(argc, argv, "hp:l:c:q:Dt:uL:R:M:I:m:H:")) != -1) {
+		switch(opt){
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 'l':
+				if (opts.nlisten == MAX_LISTEN) {
+					fprintf(stderr, "at most %d -l\n", MAX_LISTEN);
+					exit(1);
+				}
+				opts.listen[opts.nlisten++] = optarg;
+				break;
+			case 'c':
+				opts.max_client = atoi(optarg);
+				if (opts.max_client <= 0) {
+					fprintf(stderr, "-c must be positive\n");
+					exit(1);
+				}
+				break;
+			case 'q':
+				opts.high_water = atol(optarg);
+				break;
+			case 'D':
+				opts.drop_slow = 1;
+				break;
+			case 't':
+				opts.threads = atoi(optarg);
+				if ((opts.threads <= 0) || (opts.threads > MAX_SHARDS)) {
+					fprintf(stderr, "-t must be between 1 and %d\n", MAX_SHARDS);
+					exit(1);
+				}
+				break;
+			case 'u':
+				opts.uring = 1;
+				break;
+			case 'L':
+				opts.log_dir = optarg;
+				break;
+			case 'R':
+			case 'M': {
+				int rate = atoi(optarg);
+				if (rate <= 0) {
+					fprintf(stderr, "-%c must be positive\n", opt);
+					exit(1);
+				}
+				*((opt == 'R') ? &opts.rate_ns : &opts.room_rate_ns) = 1000000000 / rate;
+				break;
+			}
+			case 'm':
+				opts.metrics = optarg;
+				break;
+			case 'H':
+				opts.handoff = optarg;
+				break;
+			case 'I': {
+				int secs = atoi(optarg);
+				if (secs < 0) {
+					fprintf(stderr, "-I must not be negative\n");
+					exit(1);
+				}
+				opts.idle_ticks = (uint64_t) secs * (1000000000 / TICK_NS);
+				break;
+			}
+			case 'h':
+				printf("usage: ./server [-h] [-p port#] [-l endpoint]... [-c max#] [-q bytes] [-D] [-t threads] [-u] [-L dir] [-R #] [-M #] [-I secs] [-m port|unix:path] [-H path]\n");
+				printf("	-h - this help message\n");
+				printf("	-p # - the port to use when connecting to the server\n");
+				printf("	-l endpoint - listen on unix:path, [IPv6 address]:port, IPv4 address:port, or a port\n");
+				printf("	              on every IPv6 and IPv4 address, repeatable, instead of -p\n");
+				printf("	-c # - maximum number of concurrent clients (default %d)\n", MAX_CLIENT);
+				printf("	-q # - bytes queued for a slow client before it is disconnected (default %d)\n", HIGH_WATER);
+				printf("	-D - drop messages for a slow client instead of disconnecting it\n");
+				printf("	-t # - reactor threads, each with its own listener and clients (default 1)\n");
+				printf("	-u - use io_uring instead of epoll, if the kernel allows it\n");
+				printf("	-L dir - append every message relayed to a log in dir, see logdump\n");
+				printf("	-R # - messages a second one client may send, a second's worth at once (default no limit)\n");
+				printf("	-M # - messages a second one room may carry, likewise (default no limit)\n");
+				printf("	-I secs - ping a client quiet this long, hang up if it stays quiet as long again\n");
+				printf("	          or leaves what it is sent unread this long, 0 never (default %d)\n", IDLE_TIMEOUT);
+				printf("	-m port|unix:path - serve metrics to Prometheus on 127.0.0.1:port or a unix socket\n");
+				printf("	-H path - hot restart: take over the clients of the server on this unix socket,\n");
+				printf("	          if one is running, and hand them to the next one started with it\n");
+				exit(0);
+		}
+	}
+
+	// a client hanging up mid-write is an EPIPE, not a signal
+	signal(SIGPIPE, SIG_IGN);
+
+	// every client is an fd, raise the soft limit as far as allowed
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	// for server, s2mFDs[WFD] & m2sFDs[RFD]
+	// for monitor, s2mFDs[RFD] & m2sFDs[WFD]
+	int s2mFDs[2], m2sFDs[2];
+
+	// pipe
+	if ((pipe(s2mFDs) == -1) || (pipe(m2sFDs) == -1))
+		error_exit("pipe");
+
+	// the monitor feed, shared with the child
+	feed = mmap(NULL, sizeof(struct mon_feed), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (feed == MAP_FAILED)
+		error_exit("mmap monitor feed");
+	for (unsigned long i = 0; i < MON_SLOTS; i++)
+		atomic_init(&feed->slots[i].seq, i);
+
+	// fork
+	pid_t pid = fork();
+	if (pid < 0) error_exit("fork");
+	else if (pid == 0) {
+		// child
+		close(s2mFDs[WFD]);
+		close(m2sFDs[RFD]);
+		monitor(s2mFDs[RFD], m2sFDs[WFD]);
+		close(s2mFDs[RFD]);
+		close(m2sFDs[WFD]);
+		exit(0);
+	}
+	else {
+		// parent
+		close(m2sFDs[WFD]);
+		close(s2mFDs[RFD]);
+		relay.monitor_pid = pid;
+		server(m2sFDs[RFD], s2mFDs[WFD], port);
+		close(m2sFDs[RFD]);
+		close(s2mFDs[WFD]);
+		wait(0);
+	}
+
+	return 0;
+}
+
+
+void error_exit(const char* error) {
+	perror(error);
+	exit(-1);
+}
+
+/*
+ * connect_wait - calls listen() and bind()
+ * @param socketFD - set to the listener
+ * @param endpoint - unix:path, [IPv6 address]:port, IPv4 address:port, or a port
+ * 		    on every IPv6 and IPv4 address, NULL for every IPv4 address on port
+ * @param port - port number, -p
+ */
+void connect_wait(int *socketFD, const char* endpoint, int port) {
+	struct sockaddr_storage serv_addr;
+	socklen_t addr_len;
+	memset(&serv_addr, 0, sizeof(serv_addr));
+
+	if (endpoint && (strncmp(endpoint, "unix:", 5) == 0)) {
+		struct sockaddr_un* un = (struct sockaddr_un*) &serv_addr;
+		if (strlen(endpoint + 5) >= sizeof(un->sun_path)) {
+			fprintf(stderr, "-l path too long: %s\n", endpoint);
+			exit(1);
+		}
+		un->sun_family = AF_UNIX;
+		strcpy(un->sun_path, endpoint + 5);
+		addr_len = sizeof(*un);
+		// left behind by an earlier run
+		unlink(un->sun_path);
+	}
+	else if (endpoint) {
+		char host[INET6_ADDRSTRLEN + 2] = "::";
+		const char* serv = strrchr(endpoint, ':');
+		struct addrinfo hints = { .ai_flags = AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV, .ai_socktype = SOCK_STREAM }, *ai;
+		if (serv) {
+			// brackets around an IPv6 address
+			const char* h = endpoint + (endpoint[0] == '[');
+			int n = serv - h - (serv[-1] == ']');
+			if ((n <= 0) || (n >= (int) sizeof(host))) {
+				fprintf(stderr, "bad -l address: %s\n", endpoint);
+				exit(1);
+			}
+			memcpy(host, h, n);
+			host[n] = '\0';
+			serv++;
+		}
+		else
+			serv = endpoint;
+		int err = getaddrinfo(host, serv, &hints, &ai);
+		if (err != 0) {
+			fprintf(stderr, "bad -l address %s: %s\n", endpoint, gai_strerror(err));
+			exit(1);
+		}
+		memcpy(&serv_addr, ai->ai_addr, ai->ai_addrlen);
+		addr_len = ai->ai_addrlen;
+		freeaddrinfo(ai);
+	}
+	else {
+		struct sockaddr_in* in = (struct sockaddr_in*) &serv_addr;
+		in->sin_family = AF_INET;
+		in->sin_addr.s_addr = INADDR_ANY;
+		in->sin_port = htons(port);
+		addr_len = sizeof(*in);
+	}
+
+	if ((*socketFD = socket(serv_addr.ss_family, SOCK_STREAM, 0)) == -1)
+		error_exit("socket");
+
+	int val = 1;
+	if (serv_addr.ss_family != AF_UNIX)
+		setsockopt(*socketFD, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val));
+	// :: takes IPv4 clients too, whatever net.ipv6.bindv6only says
+	if (serv_addr.ss_family == AF_INET6) {
+		val = !IN6_IS_ADDR_UNSPECIFIED(&((struct sockaddr_in6*) &serv_addr)->sin6_addr);
+		setsockopt(*socketFD, IPPROTO_IPV6, IPV6_V6ONLY, &val, sizeof(val));
+	}
+
+	if(bind(*socketFD, (struct sockaddr*) &serv_addr, addr_len) == -1)
+		error_exit("bind");
+
+	if(listen(*socketFD, SOMAXCONN) == -1)
+		error_exit("listen");
+
+	// accept() is drained until EAGAIN
+	set_nonblock(*socketFD);
+}
+
+/*
+ * connect_accept - accept clients when socketFD is ready
+ * 		  - accepts until EAGAIN, the listener is edge-triggered
+ * 		  - adds clientFD to the epoll set and the table
+ *
+ * @param sh - the shard whose listener is ready
+ * @param l - the listener
+ */
+void connect_accept(struct shard* sh, struct conn* l)
+{
+	struct conn_table* table = &sh->table;
+	int socketFD = l->fd;
+	struct sockaddr_storage client_addr;
+	socklen_t addr_size;
+	int acceptFD;
+
+	while (1) {
+		addr_size = sizeof(client_addr);
+		STAT_ADD(&table->stats, syscalls, 1);
+		if ((acceptFD = accept(socketFD, (struct sockaddr *)&client_addr, &addr_size)) == -1) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				return;
+			if ((errno == ECONNABORTED) || (errno == EINTR))
+				continue;
+			// out of fds, free the spare to accept and hang up,
+			// otherwise the pending client keeps the listener ready forever
+			if (((errno == EMFILE) || (errno == ENFILE)) && (table->spare_fd != -1)) {
+				close(table->spare_fd);
+				if ((acceptFD = accept(socketFD, NULL, NULL)) != -1)
+					conn_refuse(acceptFD);
+				table->spare_fd = open("/dev/null", O_RDONLY);
+				continue;
+			}
+			error_exit("accept");
+		}
+
+		//connect message
+		//printf("Client connected from %s...\n", inet_ntoa(client_addr.sin_addr));
+		conn_admit(sh, acceptFD);
+	}
+}
+
+/*
+ * conn_admit - add an accepted client to the shard
+ * 	      - turns it away with FULL_MSG once opts.max_client are connected
+ * @param sh - the shard that accepted it
+ * @param fd - the client's fd
+ */
+void conn_admit(struct shard* sh, int fd) {
+	if (atomic_fetch_add_explicit(&relay.nclients, 1, memory_order_relaxed) >= opts.max_client) {
+		atomic_fetch_sub_explicit(&relay.nclients, 1, memory_order_relaxed);
+		conn_refuse(fd);
+		return;
+	}
+
+	// add it to the table and the epoll set or the ring
+	// a slow client must never block the server
+	set_nonblock(fd);
+	struct conn* c = conn_alloc(&sh->table, fd);
+	STAT_ADD(&sh->table.stats, accepted, 1);
+	// accepted by io_uring while handing over, only the successor reads it
+	if (sh->stopped) {
+		c->throttled = 1;
+		wheel_del(&sh->table.wheel, &c->idle);
+		return;
+	}
+	if (sh->table.ur)
+		uring_recv(&sh->table, c);
+	else
+		watch(sh->epfd, c);
+}
+
+/*
+ * send_recv - recv() from the client whose fd is ready to be read from
+ *	     - reads until EAGAIN, the client is edge-triggered
+ *	     - on receiving 0 < bytes, error_exit
+ *	     - on receiving 0 byte or a reset, remove client from the table
+ *	     - complete frames go to the other clients in the chat by conn_input()
+ * @param sh - the client's shard
+ * @param client - the ready client
+ */
+void send_recv(struct shard* sh, struct conn* client) {
+	struct conn_table* table = &sh->table;
+	int recv_bytes, start;
+	struct msg* m;
+
+	// sent EOF already, over its rate, left in the socket until its timer fires
+	if (client->closing || client->throttled || conn_throttle(table, client))
+		return;
+
+	// received straight into a shared buffer, receivers queue references to it,
+	// the rest of a partial frame goes into the client's own buffer
+	for (;;) {
+		m = client->part ? client->part : rx_buf(table);
+		start = client->part ? client->part_off : m->len;
+		STAT_ADD(&table->stats, syscalls, 1);
+		if ((recv_bytes = recv(client->fd, m->data + m->len, MSG_SIZE - m->len, 0)) <= 0)
+			break;
+		m->len += recv_bytes;
+		client->last_in = table->now / TICK_NS;
+		STAT_ADD(&table->stats, bytes_in, recv_bytes);
+		conn_input(sh, client, m, start);
+		// bad frame, or over its rate
+		if ((client->fd == -1) || client->throttled)
+			return;
+	}
+
+	if ((recv_bytes < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+		return;
+	if ((recv_bytes < 0) && (errno != ECONNRESET))
+		error_exit("receive send_recv");
+
+	// client hung up, or only its side with EOF
+	if (recv_bytes == 0)
+		conn_eof(table, client);
+	else
+		conn_close(table, client);
+	//printf("The client has disconnected");
+}
+
+
+/*
+ * conn_input - relay the complete frames received from a client
+ * 	      - frames are relayed in place, only a partial frame at the end is copied,
+ * 	        to the front of c->part, where the rest of it is received,
+ * 	        and so are the frames after one that finds the client throttled
+ * 	      - an invalid frame hangs up on the client
+ * @param sh - the client's shard
+ * @param c - the client
+ * @param m - buffer the bytes were received into
+ * @param off - first unparsed byte in m, up to m->len
+ */
+void conn_input(struct shard* sh, struct conn* c, struct msg* m, int off) {
+	struct conn_table* table = &sh->table;
+	struct frame f;
+	int n;
+
+	while (((n = frame_decode(m->data + off, m->len - off, &f)) > 0) && (n <= m->len - off)) {
+		// over its rate, the rest waits in c->part
+		if (c->throttled || conn_throttle(table, c))
+			break;
+		frame_relay(sh, c, m, off, &f);
+		// too far behind to take a reply
+		if (c->fd == -1)
+			return;
+		off += n;
+	}
+	if (n < 0) {
+		conn_close(table, c);
+		return;
+	}
+
+	int have = m->len - off;
+	// whole frame once the header is known, the header until then
+	int want = (n > 0) ? n : FRAME_HDR;
+	if (m == c->part) {
+		if (have == 0) {
+			msg_put(table, m, 1);
+			c->part = NULL;
+			return;
+		}
+		// the rest of it still fits behind it
+		if (off + want <= MSG_SIZE) {
+			c->part_off = off;
+			return;
+		}
+	}
+	else if (have == 0)
+		return;
+
+	struct msg* p = msg_get(table);
+	memcpy(p->data, m->data + off, have);
+	p->len = have;
+	if (c->part)
+		msg_put(table, c->part, 1);
+	c->part = p;
+	c->part_off = 0;
+}
+
+/*
+ * conn_feed - relay what was received into a buffer other than c->part
+ * 	     - a provided buffer of io_uring, or held input
+ * 	     - a frame split across buffers is completed in c->part, the rest are
+ * 	       relayed in place, what arrives while the client is throttled is held
+ * @param sh - the shard
+ * @param c - the client
+ * @param m - the buffer, up to m->len
+ * @param off - first byte not relayed yet
+ */
+void conn_feed(struct shard* sh, struct conn* c, struct msg* m, int off) {
+	while (c->part && (off < m->len) && !c->throttled) {
+		struct msg* p = c->part;
+		int need = frame_need(p->data + c->part_off, p->len - c->part_off);
+		int k = (need < m->len - off) ? need : m->len - off;
+		memcpy(p->data + p->len, m->data + off, k);
+		p->len += k;
+		off += k;
+		conn_input(sh, c, p, c->part_off);
+		if (c->fd == -1)
+			return;
+	}
+	if (off == m->len)
+		return;
+	if (c->throttled)
+		conn_hold(&sh->table, c, m->data + off, m->len - off);
+	else
+		conn_input(sh, c, m, off);
+}
+
+/*
+ * conn_hold - keep a copy of bytes received from a client that is not to be read now
+ * 	     - what io_uring received before a throttled client's recv was cancelled,
+ * 	       or what the server this one took over from had not relayed yet
+ * @param table - table of the client
+ * @param c - the client
+ * @param buf - the bytes
+ * @param len - # of bytes
+ */
+void conn_hold(struct conn_table* table, struct conn* c, const char* buf, int len) {
+	while (len > 0) {
+		struct msg* m = c->held_tail;
+		if ((m == NULL) || (m->len == MSG_SIZE)) {
+			m = msg_get(table);
+			m->next_free = NULL;
+			if (c->held_tail)
+				c->held_tail->next_free = m;
+			else
+				c->held = m;
+			c->held_tail = m;
+		}
+		int k = (len < MSG_SIZE - m->len) ? len : MSG_SIZE - m->len;
+		memcpy(m->data + m->len, buf, k);
+		m->len += k;
+		buf += k;
+		len -= k;
+	}
+}
+
+/*
+ * conn_resume - relay what a client sent while it was not read, then read it again
+ * 	       - stops again where it is over its rate
+ * @param sh - the shard
+ * @param c - the client, its timer fired or it was just taken over
+ */
+void conn_resume(struct shard* sh, struct conn* c) {
+	struct conn_table* table = &sh->table;
+
+	if (c->part)
+		conn_input(sh, c, c->part, c->part_off);
+	while (c->held && (c->fd != -1) && !c->throttled) {
+		// what is left of m goes back in front of the rest
+		struct msg *m = c->held, *rest = m->next_free, *tail = c->held_tail;
+		c->held = c->held_tail = NULL;
+		conn_feed(sh, c, m, 0);
+		msg_put(table, m, 1);
+		if (c->held_tail)
+			c->held_tail->next_free = rest;
+		else
+			c->held = rest;
+		if (rest)
+			c->held_tail = tail;
+	}
+	if ((c->fd == -1) || c->throttled || c->closing)
+		return;
+	if (table->ur == NULL)
+		send_recv(sh, c);
+	else if (!c->reading)
+		uring_recv(table, c);
+}
+
+/*
+ * frame_relay - act on one frame from a client
+ * @param sh - the client's shard
+ * @param c - the client
+ * @param m - buffer holding the frame
+ * @param off - offset of the frame in m
+ * @param f - its decoded header
+ */
+void frame_relay(struct shard* sh, struct conn* c, struct msg* m, int off, struct frame* f) {
+	int len = FRAME_HDR + f->len;
+
+	// every frame counts, a replay or a join costs the server more than a message
+	rate_charge(&sh->table, c);
+	STAT_ADD(&sh->table.stats, frames_in, 1);
+	c->frames++;
+
+	switch (f->type) {
+		case FRAME_MSG:
+			history_add(relay.rooms[c->room].hist, m->data + off, len);
+			if (opts.log_dir)
+				log_append(relay.rooms[c->room].name, m->data + off, len);
+			broadcast(&sh->table, c, c->room, m, off, len);
+			shard_post(sh, c->room, m, off, len);
+			monitor_write(sh, m->data + off + FRAME_HDR, f->len);
+			break;
+
+		case FRAME_JOIN: {
+			int room = room_find(m->data + off + FRAME_HDR, f->len);
+			if (room < 0) {
+				conn_notice(&sh->table, c, (room == -1) ? "bad room name\n" : "too many rooms\n");
+				break;
+			}
+			room_leave(&sh->table, c);
+			room_join(&sh->table, c, room);
+			char text[ROOM_NAME + 16];
+			snprintf(text, sizeof(text), "joined %s\n", relay.rooms[room].name);
+			conn_notice(&sh->table, c, text);
+			break;
+		}
+
+		case FRAME_LEAVE:
+			room_leave(&sh->table, c);
+			room_join(&sh->table, c, 0);
+			break;
+
+		case FRAME_HISTORY: {
+			uint64_t after = 0;
+			if (f->len >= 8) {
+				memcpy(&after, m->data + off + FRAME_HDR, 8);
+				after = be64toh(after);
+			}
+			history_replay(&sh->table, c, relay.rooms[c->room].hist, after);
+			break;
+		}
+
+		// a client checking on us, the reply is all it needs
+		case FRAME_PING:
+			conn_control(&sh->table, c, FRAME_PONG);
+			break;
+
+		// a client asking which of its frames it may forget
+		case FRAME_ACK:
+			conn_control(&sh->table, c, FRAME_ACK);
+			break;
+
+		// from a newer client, nothing to do with it, a FRAME_PONG only has to arrive
+		default:
+			break;
+	}
+}
+
+/*
+ * broadcast - queues the received message for every client in the room except the sender
+ * @param table - clients currently in the chat
+ * @param sender - the client who sent the message, NULL for the monitor
+ * @param room - the room, ROOM_ALL for every client
+ * @param m - buffer holding the message, every receiver takes a reference
+ * @param off - offset of the message in m
+ * @param len - # of bytes of message received
+ */
+void broadcast(struct conn_table* table, struct conn* sender, int room, struct msg* m, int off, int len){
+	struct conn** to = (room == ROOM_ALL) ? table->live : table->members[room].c;
+	int n = (room == ROOM_ALL) ? table->nlive : table->members[room].n, queued = 0;
+
+	// one atomic add for every receiver, the unused ones are handed back below,
+	// the caller's reference keeps m alive meanwhile
+	atomic_fetch_add_explicit(&m->refs, n, memory_order_relaxed);
+
+	// backwards, conn_close() moves the last conn into the hole
+	for (int i = n - 1; i >= 0; i--) {
+		struct conn* receiver = to[i];
+		// catch if the receiver is the sender
+		if (receiver != sender)
+			queued += conn_send(table, receiver, m, off, len);
+	}
+	msg_put(table, m, n - queued);
+	STAT_ADD(&table->stats, broadcasts, 1);
+}
+
+/*
+ * room_find - the id of a room, created if it does not exist
+ * @param name - its name, not NUL-terminated, trailing whitespace is ignored
+ * @param len - length of name
+ * @returns the id, -1 for a bad name, -2 once MAX_ROOMS exist
+ */
+int room_find(const char* name, int len) {
+	uint32_t h = 2166136261u;
+	int id;
+
+	while ((len > 0) && ((name[len - 1] == '\n') || (name[len - 1] == '\r') || (name[len - 1] == ' ')))
+		len--;
+	if ((len == 0) || (len >= ROOM_NAME) || memchr(name, '\0', len))
+		return -1;
+
+	// FNV-1a
+	for (int i = 0; i < len; i++)
+		h = (h ^ (unsigned char) name[i]) * 16777619u;
+
+	pthread_mutex_lock(&relay.rooms_lock);
+	for (;; h++) {
+		int* slot = &relay.room_hash[h & (ROOM_HASH - 1)];
+		if (*slot == 0) {
+			if (relay.nrooms == MAX_ROOMS) {
+				id = -2;
+				break;
+			}
+			id = relay.nrooms++;
+			memcpy(relay.rooms[id].name, name, len);
+			// other shards learn the id by mail, after this
+			if ((relay.rooms[id].hist = aligned_alloc(64, sizeof(struct history))) == NULL)
+				error_exit("aligned_alloc history");
+			memset(relay.rooms[id].hist, 0, sizeof(struct history));
+			*slot = id + 1;
+			break;
+		}
+		id = *slot - 1;
+		if ((strncmp(relay.rooms[id].name, name, len) == 0) && (relay.rooms[id].name[len] == '\0'))
+			break;
+	}
+	pthread_mutex_unlock(&relay.rooms_lock);
+	return id;
+}
+
+/*
+ * room_join - add a client to a room's members on its shard
+ * @param table - the client's shard
+ * @param c - the client, in no room
+ * @param room - the room
+ */
+void room_join(struct conn_table* table, struct conn* c, int room) {
+	struct members* mb = &table->members[room];
+	if (mb->n == mb->cap) {
+		mb->cap = mb->cap ? mb->cap * 2 : 8;
+		if ((mb->c = realloc(mb->c, mb->cap * sizeof(struct conn*))) == NULL)
+			error_exit("realloc members");
+	}
+	c->room = room;
+	c->room_i = mb->n;
+	mb->c[mb->n++] = c;
+
+	// the first on this shard, other shards start posting the room's messages here
+	if (mb->n == 1)
+		atomic_fetch_or_explicit(&relay.rooms[room].shards, (uint64_t) 1 << table->id, memory_order_relaxed);
+}
+
+/*
+ * room_leave - remove a client from its room's members
+ * @param table - the client's shard
+ * @param c - the client
+ */
+void room_leave(struct conn_table* table, struct conn* c) {
+	struct members* mb = &table->members[c->room];
+
+	// move the last member into the hole
+	struct conn* last = mb->c[--mb->n];
+	mb->c[c->room_i] = last;
+	last->room_i = c->room_i;
+
+	if (mb->n == 0)
+		atomic_fetch_and_explicit(&relay.rooms[c->room].shards, ~((uint64_t) 1 << table->id), memory_order_relaxed);
+}
+
+/*
+ * conn_notice - send a message from the server to one client
+ * @param table - the client's shard
+ * @param c - the client
+ * @param text - the message
+ */
+void conn_notice(struct conn_table* table, struct conn* c, const char* text) {
+	// not rx, the frame being relayed may still be parsed from there
+	struct msg* m = msg_get(table);
+	int len = strlen(text);
+
+	frame_encode(m->data, FRAME_MSG, len);
+	memcpy(m->data + FRAME_HDR, text, len);
+	m->len = FRAME_HDR + len;
+	// the queue takes our reference
+	if (!conn_send(table, c, m, 0, m->len))
+		msg_put(table, m, 1);
+}
+
+/*
+ * rate_charge - take a token for a frame from the client's bucket and its room's
+ * 	       - GCRA, the due time moves one interval past now, or past where it was
+ * 	         while in debt, reads stop once it is more than a burst ahead
+ * @param table - table of the client
+ * @param c - the client
+ */
+void rate_charge(struct conn_table* table, struct conn* c) {
+	uint64_t now = table->now;
+
+	if (opts.rate_ns)
+		c->tat = ((c->tat > now) ? c->tat : now) + opts.rate_ns;
+	if (opts.room_rate_ns) {
+		_Atomic uint64_t* tat = &relay.rooms[c->room].tat;
+		uint64_t t = atomic_load_explicit(tat, memory_order_relaxed), next;
+		do
+			next = ((t > now) ? t : now) + opts.room_rate_ns;
+		while (!atomic_compare_exchange_weak_explicit(tat, &t, next, memory_order_relaxed, memory_order_relaxed));
+	}
+}
+
+/*
+ * conn_throttle - stop reading a client that is over its rate or its room's
+ * 		 - its timer fires once both allow a message again, a burst is a second's worth
+ * @param table - table of the client
+ * @param c - the client
+ * @returns 1 if throttled
+ */
+int conn_throttle(struct conn_table* table, struct conn* c) {
+	uint64_t now = table->now, due = 0, burst;
+
+	// how far ahead the due time may run, a second less one message
+	if (opts.rate_ns) {
+		burst = 1000000000 - opts.rate_ns;
+		if (c->tat > now + burst)
+			due = c->tat - burst;
+	}
+	if (opts.room_rate_ns) {
+		uint64_t t = atomic_load_explicit(&relay.rooms[c->room].tat, memory_order_relaxed);
+		burst = 1000000000 - opts.room_rate_ns;
+		if ((t > now + burst) && (t - burst > due))
+			due = t - burst;
+	}
+	if (due == 0)
+		return 0;
+
+	c->throttled = 1;
+	STAT_ADD(&table->stats, throttled, 1);
+	wheel_add(&table->wheel, &c->timer, (due + TICK_NS - 1) / TICK_NS);
+	return 1;
+}
+
+/*
+ * shard_timers - read the clients whose throttle timers fired, check on those whose idle timers did
+ * @param sh - the shard
+ */
+void shard_timers(struct shard* sh) {
+	struct conn_table* table = &sh->table;
+	struct wheel_node* n = wheel_expire(&table->wheel, table->now / TICK_NS);
+
+	while (n) {
+		int kind = n->kind;
+		struct conn* c = (struct conn*) ((char*) n - ((kind == TIMER_IDLE) ? offsetof(struct conn, idle) : offsetof(struct conn, timer)));
+		// reading c may arm its timer again
+		n = n->next;
+		// hung up on by the other timer of the same tick
+		if (c->fd == -1)
+			continue;
+		if (kind == TIMER_IDLE) {
+			conn_heartbeat(table, c);
+			continue;
+		}
+		c->throttled = 0;
+		conn_resume(sh, c);
+	}
+}
+
+/*
+ * conn_heartbeat - check on a client whose idle timer fired, and arm it again
+ * 		  - quiet for opts.idle_ticks, it is sent a PING, quiet for twice that, it is
+ * 		    hung up on, half-open, and so is one that left its output unread that long
+ * @param table - table of the client
+ * @param c - the client
+ */
+void conn_heartbeat(struct conn_table* table, struct conn* c) {
+	uint64_t now = table->now / TICK_NS, idle = opts.idle_ticks;
+
+	// not read on purpose
+	if (c->throttled)
+		c->last_in = now;
+	if ((now - c->last_in >= 2 * idle) || ((c->out_count > 0) && (now - c->last_out >= idle))) {
+		STAT_ADD(&table->stats, idle_closed, 1);
+		conn_close(table, c);
+		return;
+	}
+
+	uint64_t due = c->last_in + idle;
+	if (now >= due) {
+		// once per quiet spell
+		if (c->pinged <= c->last_in) {
+			c->pinged = now;
+			conn_control(table, c, FRAME_PING);
+			if (c->fd == -1)
+				return;
+		}
+		due = c->last_in + 2 * idle;
+	}
+	if ((c->out_count > 0) && (c->last_out + idle < due))
+		due = c->last_out + idle;
+	wheel_add(&table->wheel, &c->idle, due);
+}
+
+/*
+ * conn_refuse - turn a client away with FULL_MSG in a FRAME_FULL and hang up
+ * 	       - best effort, the frame is small enough for any socket buffer
+ * @param fd - the client's fd, closed
+ */
+void conn_refuse(int fd) {
+	char buf[FRAME_HDR + sizeof(FULL_MSG) - 1];
+
+	frame_encode(buf, FRAME_FULL, sizeof(FULL_MSG) - 1);
+	memcpy(buf + FRAME_HDR, FULL_MSG, sizeof(FULL_MSG) - 1);
+	send(fd, buf, sizeof(buf), MSG_DONTWAIT | MSG_NOSIGNAL);
+	close(fd);
+}
+
+/*
+ * conn_control - queue a frame without payload for a client
+ * @param table - table of the client
+ * @param c - the client
+ * @param type - FRAME_PING, FRAME_PONG or FRAME_ACK, which carries c->frames
+ */
+void conn_control(struct conn_table* table, struct conn* c, int type) {
+	struct msg* m = msg_get(table);
+
+	frame_encode(m->data, type, 0);
+	if (type == FRAME_ACK)
+		frame_stamp(m->data, c->frames);
+	m->len = FRAME_HDR;
+	// the queue takes our reference
+	if (!conn_send(table, c, m, 0, m->len))
+		msg_put(table, m, 1);
+}
+
+uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * history_add - number a message of a room and keep a copy of it
+ * 	       - a frame over HIST_FRAME is numbered but not kept
+ * @param h - the room's history
+ * @param frame - the frame, its seq is stamped in place before it is relayed
+ * @param len - its size
+ */
+void history_add(struct history* h, char* frame, int len) {
+	uint64_t seq = atomic_fetch_add_explicit(&h->seq, 1, memory_order_relaxed) + 1;
+	struct hist_slot* s = &h->slots[seq & (HIST_SLOTS - 1)];
+
+	frame_stamp(frame, seq);
+	if (len > HIST_FRAME)
+		return;
+
+	// another shard may still be writing the slot a lap behind
+	unsigned v = atomic_load_explicit(&s->ver, memory_order_relaxed);
+	for (;;) {
+		if (v & 1)
+			v = atomic_load_explicit(&s->ver, memory_order_relaxed);
+		else if (atomic_compare_exchange_weak_explicit(&s->ver, &v, v + 1, memory_order_relaxed, memory_order_relaxed))
+			break;
+	}
+	// readers that see the new bytes see the odd version
+	atomic_thread_fence(memory_order_release);
+
+	// unless a later lap got there first
+	if (s->seq < seq) {
+		memcpy(s->frame, frame, len);
+		s->len = len;
+		s->seq = seq;
+	}
+	atomic_store_explicit(&s->ver, v + 2, memory_order_release);
+}
+
+/*
+ * history_replay - queue the room's kept messages after a seq for one client, flushed with the batch
+ * 		  - frames are copied out into as few msgs as they fit in,
+ * 		    a slot being written, or rewritten while copied, is skipped
+ * @param table - table of the client
+ * @param c - the client
+ * @param h - its room's history
+ * @param after - last seq the client has, 0 for everything kept
+ */
+void history_replay(struct conn_table* table, struct conn* c, struct history* h, uint64_t after) {
+	uint64_t last = atomic_load_explicit(&h->seq, memory_order_relaxed);
+	uint64_t first = (last > HIST_SLOTS) ? last - HIST_SLOTS + 1 : 1;
+	struct msg* m = msg_get(table);
+
+	if (after >= first)
+		first = after + 1;
+
+	for (uint64_t seq = first; seq <= last; seq++) {
+		struct hist_slot* s = &h->slots[seq & (HIST_SLOTS - 1)];
+		unsigned v = atomic_load_explicit(&s->ver, memory_order_acquire);
+		int len = s->len;
+		// being written, not kept, or not written yet
+		if ((v & 1) || (s->seq != seq) || (len > HIST_FRAME))
+			continue;
+
+		if (m->len + len > MSG_SIZE) {
+			// the queue takes our reference
+			if (!conn_send(table, c, m, 0, m->len)) {
+				msg_put(table, m, 1);
+				return;
+			}
+			m = msg_get(table);
+		}
+		memcpy(m->data + m->len, s->frame, len);
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&s->ver, memory_order_relaxed) != v)
+			continue;
+		m->data[m->len + 5] |= FRAME_F_HISTORY;
+		m->len += len;
+	}
+
+	if ((m->len == 0) || !conn_send(table, c, m, 0, m->len))
+		msg_put(table, m, 1);
+}
+
+/*
+ * log_init - continue the log in opts.log_dir after its last segment, start the flusher
+ */
+void log_init(void) {
+	unsigned long* nums;
+	uint64_t base = 0;
+	int n;
+
+	if ((mkdir(opts.log_dir, 0755) == -1) && (errno != EEXIST))
+		error_exit("mkdir log");
+	if ((n = log_list(opts.log_dir, &nums)) == -1)
+		error_exit("log_list");
+
+	if (n > 0)
+		chatlog.last = nums[n - 1];
+	// spares the last run created ahead and never started
+	while ((n > 0) && (log_base(opts.log_dir, nums[n - 1], &base) == -1)) {
+		char path[PATH_MAX];
+		log_path(path, sizeof(path), opts.log_dir, nums[n - 1], "log");
+		unlink(path);
+		log_path(path, sizeof(path), opts.log_dir, nums[n - 1], "idx");
+		unlink(path);
+		n--;
+	}
+
+	// the lsn after the last record of the last segment
+	if (n > 0) {
+		char path[PATH_MAX];
+		struct stat st;
+		log_path(path, sizeof(path), opts.log_dir, nums[n - 1], "log");
+		int fd = open(path, O_RDONLY);
+		if ((fd == -1) || (fstat(fd, &st) == -1))
+			error_exit("open log");
+		if (st.st_size >= LOG_SEG_HDR) {
+			char* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			if (map == MAP_FAILED)
+				error_exit("mmap log");
+			const struct log_rec* r;
+			size_t off = LOG_SEG_HDR;
+			while ((r = log_next(map, st.st_size, &off)) != NULL)
+				base = r->lsn + 1;
+			munmap(map, st.st_size);
+		}
+		close(fd);
+	}
+	free(nums);
+
+	struct log_seg* seg = log_create(++chatlog.last);
+	log_start(seg, base);
+	atomic_store(&chatlog.cur, seg);
+	if ((errno = pthread_create(&chatlog.flusher, NULL, log_flush, NULL)) != 0)
+		error_exit("pthread_create log");
+}
+
+/*
+ * log_append - append a relayed frame to the log, no syscall
+ * 	      - one fetch_add reserves its lsn and bytes, records are copied in parallel,
+ * 		the first record that does not fit rolls over to the next segment
+ * @param room - name of the frame's room
+ * @param frame - the frame, seq stamped
+ * @param len - its size
+ */
+void log_append(const char* room, const char* frame, int len) {
+	int namelen = strlen(room);
+	uint32_t size = log_rec_size(namelen, len);
+
+	for (;;) {
+		struct log_seg* seg = atomic_load_explicit(&chatlog.cur, memory_order_acquire);
+		uint64_t t = atomic_fetch_add_explicit(&seg->tail, ((uint64_t) 1 << 32) | size, memory_order_relaxed);
+		uint32_t off = (uint32_t) t, records = t >> 32;
+
+		if (off + size <= LOG_SEGMENT) {
+			struct log_rec* r = (struct log_rec*) (seg->map + off);
+			r->namelen = namelen;
+			r->lsn = seg->base + records;
+			memcpy(r->data, room, namelen);
+			memcpy(r->data + namelen, frame, len);
+			if (records % LOG_INDEX_EVERY == 0)
+				seg->index[records / LOG_INDEX_EVERY] = off + 1;
+			// readers stop at a len of 0
+			atomic_store_explicit((_Atomic uint32_t*) &r->len, size, memory_order_release);
+			atomic_fetch_add_explicit(&seg->filled, size, memory_order_release);
+			return;
+		}
+
+		// the first that does not fit rolls over, the ones after it wait for the next segment
+		if (off <= LOG_SEGMENT)
+			log_roll(seg, off, records);
+		else
+			while (atomic_load_explicit(&chatlog.cur, memory_order_acquire) == seg)
+				sched_yield();
+	}
+}
+
+/*
+ * log_roll - switch the log to the next segment, the flusher's spare if it made one
+ * @param seg - the full segment
+ * @param end - where its records stop
+ * @param records - # of records in it
+ */
+void log_roll(struct log_seg* seg, uint64_t end, uint64_t records) {
+	pthread_mutex_lock(&chatlog.roll);
+	struct log_seg* next = chatlog.spare;
+	chatlog.spare = NULL;
+	if (next == NULL)
+		next = log_create(++chatlog.last);
+	log_start(next, seg->base + records);
+
+	seg->end = end;
+	seg->next_retired = chatlog.retired;
+	chatlog.retired = seg;
+	atomic_store_explicit(&chatlog.cur, next, memory_order_release);
+	pthread_mutex_unlock(&chatlog.roll);
+}
+
+/*
+ * log_create - create and map a segment and its index, blocks allocated and faulted in up front
+ * @param num - its number
+ * @returns the segment, not started
+ */
+struct log_seg* log_create(unsigned long num) {
+	struct log_seg* seg = calloc(1, sizeof(struct log_seg));
+	char path[PATH_MAX];
+	int err;
+
+	if (seg == NULL)
+		error_exit("calloc log_seg");
+	seg->num = num;
+	log_path(path, sizeof(path), opts.log_dir, num, "log");
+	if ((seg->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1)
+		error_exit("open log segment");
+	// so fdatasync() never has block allocations to write out
+	if ((err = posix_fallocate(seg->fd, 0, LOG_SEGMENT)) != 0) {
+		errno = err;
+		error_exit("posix_fallocate log segment");
+	}
+	seg->map = mmap(NULL, LOG_SEGMENT, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, seg->fd, 0);
+	if (seg->map == MAP_FAILED)
+		error_exit("mmap log segment");
+
+	log_path(path, sizeof(path), opts.log_dir, num, "idx");
+	if (((seg->ifd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) ||
+			(ftruncate(seg->ifd, LOG_INDEX_SLOTS * sizeof(uint32_t)) == -1))
+		error_exit("open log index");
+	seg->index = mmap(NULL, LOG_INDEX_SLOTS * sizeof(uint32_t), PROT_READ | PROT_WRITE, MAP_SHARED, seg->ifd, 0);
+	if (seg->index == MAP_FAILED)
+		error_exit("mmap log index");
+	return seg;
+}
+
+// give a created segment its first lsn, ready to append to
+void log_start(struct log_seg* seg, uint64_t base) {
+	struct log_seg_hdr* h = (struct log_seg_hdr*) seg->map;
+	memcpy(h->magic, LOG_MAGIC, sizeof(h->magic));
+	h->base = base;
+	seg->base = base;
+	atomic_store_explicit(&seg->tail, LOG_SEG_HDR, memory_order_relaxed);
+}
+
+// cut a complete segment to its records, sync it and release its mappings
+void log_close(struct log_seg* seg) {
+	if ((ftruncate(seg->fd, seg->end) == -1) || (fdatasync(seg->fd) == -1) || (fdatasync(seg->ifd) == -1))
+		error_exit("sync log segment");
+	munmap(seg->map, LOG_SEGMENT);
+	munmap(seg->index, LOG_INDEX_SLOTS * sizeof(uint32_t));
+	close(seg->fd);
+	close(seg->ifd);
+}
+
+/*
+ * log_flush - the log's background thread, the shards never sync
+ * 	     - every LOG_SYNC_MS, one fdatasync() for everything appended since the last,
+ * 	       closes rolled over segments once complete, and creates the next one ahead
+ * @param arg - unused
+ */
+void* log_flush(void* arg) {
+	struct timespec tick = { 0, LOG_SYNC_MS * 1000000 };
+	(void) arg;
+
+	for (;;) {
+		nanosleep(&tick, NULL);
+
+		// records copied, not only reserved, their index slots are written before filled,
+		// one still being copied bumps filled once done and is synced on the next tick
+		struct log_seg* seg = atomic_load_explicit(&chatlog.cur, memory_order_acquire);
+		uint64_t f = atomic_load_explicit(&seg->filled, memory_order_acquire);
+		if (f != seg->synced) {
+			if ((fdatasync(seg->fd) == -1) || (fdatasync(seg->ifd) == -1))
+				error_exit("fdatasync log");
+			seg->synced = f;
+		}
+
+		// take the complete ones off the list, close them outside the lock
+		struct log_seg *done = NULL, **p;
+		pthread_mutex_lock(&chatlog.roll);
+		for (p = &chatlog.retired; *p;) {
+			struct log_seg* r = *p;
+			if (atomic_load_explicit(&r->filled, memory_order_acquire) != r->end - LOG_SEG_HDR) {
+				p = &r->next_retired;
+				continue;
+			}
+			*p = r->next_retired;
+			r->next_retired = done;
+			done = r;
+		}
+		// under the lock, so segment numbers follow the lsns
+		if (chatlog.spare == NULL)
+			chatlog.spare = log_create(++chatlog.last);
+		pthread_mutex_unlock(&chatlog.roll);
+
+		for (; done; done = done->next_retired)
+			log_close(done);
+	}
+	return NULL;
+}
+
+/*
+ * handoff_connect - connect to the server handing over on opts.handoff, -H
+ * @returns the socket, -1 if no server is there
+ */
+int handoff_connect(void) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (strlen(opts.handoff) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "-H path too long\n");
+		exit(1);
+	}
+	strcpy(addr.sun_path, opts.handoff);
+	if ((fd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1)
+		error_exit("socket handoff");
+	if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * handoff_begin - take over the listeners, sent once the server before has parked its shards
+ * @param fd - the handoff socket
+ * @param hh - set to the header
+ * @param listeners - set to hh->nlisten listening sockets for each of hh->nshards shards
+ */
+void handoff_begin(int fd, struct handoff_hdr* hh, int listeners[][MAX_LISTEN]) {
+	if ((handoff_recv(fd, hh, sizeof(*hh), NULL, 0) != sizeof(*hh)) ||
+			(memcmp(hh->magic, HANDOFF_MAGIC, sizeof(hh->magic)) != 0) ||
+			(hh->nshards <= 0) || (hh->nshards > MAX_SHARDS) || (hh->nlisten <= 0) || (hh->nlisten > MAX_LISTEN)) {
+		fprintf(stderr, "bad handoff from %s\n", opts.handoff);
+		exit(1);
+	}
+	for (int i = 0; i < hh->nshards; i++) {
+		int id = -1;
+		for (int j = 0; j < MAX_LISTEN; j++)
+			listeners[i][j] = -1;
+		if ((handoff_recv(fd, &id, sizeof(id), listeners[i], MAX_LISTEN) != sizeof(id)) || (id != i) ||
+				(listeners[i][hh->nlisten - 1] == -1)) {
+			fprintf(stderr, "bad handoff from %s\n", opts.handoff);
+			exit(1);
+		}
+	}
+}
+
+/*
+ * handoff_adopt - take over the rooms and the clients, before any shard runs
+ * 		 - clients are spread across the shards, what they had sent is held
+ * 		   for shard_adopted(), what they had queued is queued again
+ * @param fd - the handoff socket, closed once the server before has exited
+ * @param hh - its header
+ */
+void handoff_adopt(int fd, struct handoff_hdr* hh) {
+	char* buf = NULL;
+	size_t cap = 0;
+
+	for (int i = 0; i < hh->nrooms; i++) {
+		struct handoff_room hr;
+		if (handoff_recv(fd, &hr, sizeof(hr), NULL, 0) != sizeof(hr))
+			error_exit("handoff room");
+		// by id, so they get the same ids again
+		struct room* r = &relay.rooms[room_find(hr.name, strnlen(hr.name, ROOM_NAME))];
+		if (r != &relay.rooms[i]) {
+			fprintf(stderr, "bad handoff room %.*s\n", ROOM_NAME, hr.name);
+			exit(1);
+		}
+		atomic_store(&r->tat, hr.tat);
+		atomic_store(&r->hist->seq, hr.seq);
+
+		if ((hr.histlen > cap) && ((buf = realloc(buf, cap = hr.histlen)) == NULL))
+			error_exit("realloc handoff");
+		handoff_take(fd, buf, hr.histlen);
+		struct frame f;
+		for (int off = 0, n; off < (int) hr.histlen; off += n) {
+			n = frame_decode(buf + off, hr.histlen - off, &f);
+			if ((n <= 0) || (n > HIST_FRAME) || (n > (int) hr.histlen - off)) {
+				fprintf(stderr, "bad handoff history\n");
+				exit(1);
+			}
+			struct hist_slot* s = &r->hist->slots[f.seq & (HIST_SLOTS - 1)];
+			memcpy(s->frame, buf + off, n);
+			s->len = n;
+			s->seq = f.seq;
+		}
+	}
+
+	for (int i = 0; i < hh->nconns; i++) {
+		struct handoff_conn hc;
+		int cfd = -1;
+		if ((handoff_recv(fd, &hc, sizeof(hc), &cfd, 1) != sizeof(hc)) || (cfd == -1))
+			error_exit("handoff conn");
+		size_t len = (size_t) hc.inlen + hc.outlen;
+		if ((len > cap) && ((buf = realloc(buf, cap = len)) == NULL))
+			error_exit("realloc handoff");
+		handoff_take(fd, buf, len);
+
+		struct shard* sh = &relay.shards[i % relay.nshards];
+		struct conn_table* table = &sh->table;
+		atomic_fetch_add_explicit(&relay.nclients, 1, memory_order_relaxed);
+		struct conn* c = conn_alloc(table, cfd);
+		if ((hc.room > 0) && (hc.room < relay.nrooms)) {
+			room_leave(table, c);
+			room_join(table, c, hc.room);
+		}
+		c->tat = hc.tat;
+		c->drops = hc.drops;
+		c->frames = hc.frames;
+		conn_hold(table, c, buf, hc.inlen);
+		for (uint32_t off = 0; (off < hc.outlen) && (c->fd != -1); ) {
+			struct msg* m = msg_get(table);
+			int k = (hc.outlen - off < MSG_SIZE) ? hc.outlen - off : MSG_SIZE;
+			memcpy(m->data, buf + hc.inlen + off, k);
+			m->len = k;
+			// the queue takes our reference
+			if (!conn_send(table, c, m, 0, k))
+				msg_put(table, m, 1);
+			off += k;
+		}
+		if ((c->fd != -1) && !opts.uring)
+			watch(sh->epfd, c);
+	}
+	free(buf);
+
+	// it exits once everything is sent, which frees the metrics port too
+	char b;
+	while (recv(fd, &b, 1, 0) > 0)
+		;
+	close(fd);
+}
+
+/*
+ * handoff_listen - wait on opts.handoff for a successor, from a thread of its own
+ */
+void handoff_listen(void) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+
+	strcpy(addr.sun_path, opts.handoff);
+	// left by the server before, or one that crashed
+	unlink(addr.sun_path);
+	if ((fd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1)
+		error_exit("socket handoff");
+	if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1)
+		error_exit("bind handoff");
+	if (listen(fd, 1) == -1)
+		error_exit("listen handoff");
+
+	pthread_t tid;
+	if ((errno = pthread_create(&tid, NULL, handoff_serve, (void*) (intptr_t) fd)) != 0)
+		error_exit("pthread_create handoff");
+	pthread_detach(tid);
+}
+
+/*
+ * handoff_serve - hand everything over to the first successor that connects, then exit
+ * 		 - the shards stop reading clients, and once none has mail left for another,
+ * 		   drain their mailboxes and park, the clients never see a hang-up,
+ * 		   what they send meanwhile waits in their sockets
+ * @param arg - the listening socket
+ */
+void* handoff_serve(void* arg) {
+	int lfd = (int) (intptr_t) arg, fd;
+	uint64_t one = 1;
+
+	while ((fd = accept(lfd, NULL, NULL)) == -1)
+		if ((errno != EINTR) && (errno != ECONNABORTED))
+			error_exit("accept handoff");
+
+	// each step until every shard is through it, ringing the ones asleep
+	for (int phase = 1; phase <= 2; phase++) {
+		atomic_int* done = (phase == 1) ? &relay.quiet : &relay.parked;
+		atomic_store_explicit(&relay.handoff, phase, memory_order_release);
+		while (atomic_load_explicit(done, memory_order_acquire) < relay.nshards) {
+			for (int i = 0; i < relay.nshards; i++)
+				if ((write(relay.shards[i].evfd, &one, sizeof(one)) == -1) && (errno != EAGAIN))
+					error_exit("write eventfd");
+			usleep(1000);
+		}
+	}
+
+	// the successor binds the metrics port, and continues the log after the last record
+	if (opts.metrics)
+		shutdown(relay.metrics_fd, SHUT_RDWR);
+	if (opts.log_dir) {
+		// kept, so the flusher makes no more segments
+		pthread_mutex_lock(&chatlog.roll);
+		struct log_seg* seg = atomic_load(&chatlog.cur);
+		uint32_t end = (uint32_t) atomic_load(&seg->tail);
+		if ((ftruncate(seg->fd, (end < LOG_SEGMENT) ? end : LOG_SEGMENT) == -1) ||
+				(fdatasync(seg->fd) == -1) || (fdatasync(seg->ifd) == -1))
+			error_exit("sync log segment");
+		for (struct log_seg* r = chatlog.retired; r; r = r->next_retired)
+			fdatasync(r->fd);
+	}
+
+	struct handoff_hdr hh = { HANDOFF_MAGIC, relay.nshards, opts.nlisten, relay.nrooms, 0 };
+	for (int i = 0; i < relay.nshards; i++)
+		hh.nconns += relay.shards[i].table.nlive;
+	handoff_send(fd, &hh, sizeof(hh), NULL, 0);
+	for (int i = 0; i < relay.nshards; i++) {
+		int listeners[MAX_LISTEN];
+		for (int j = 0; j < opts.nlisten; j++)
+			listeners[j] = relay.shards[i].listeners[j].fd;
+		handoff_send(fd, &i, sizeof(i), listeners, opts.nlisten);
+	}
+
+	struct handoff_out* o = malloc(sizeof(struct handoff_out));
+	if (o == NULL)
+		error_exit("malloc handoff");
+	o->fd = fd;
+	o->len = 0;
+
+	// rooms, with the messages their histories still have
+	for (int i = 0; i < relay.nrooms; i++) {
+		struct room* r = &relay.rooms[i];
+		struct history* h = r->hist;
+		struct handoff_room hr = { .seq = atomic_load(&h->seq), .tat = atomic_load(&r->tat) };
+		uint64_t first = (hr.seq > HIST_SLOTS) ? hr.seq - HIST_SLOTS + 1 : 1;
+		memcpy(hr.name, r->name, ROOM_NAME);
+		for (int pass = 0; pass < 2; pass++)
+			for (uint64_t seq = first; seq <= hr.seq; seq++) {
+				struct hist_slot* s = &h->slots[seq & (HIST_SLOTS - 1)];
+				if ((s->seq != seq) || (s->len > HIST_FRAME))
+					continue;
+				if (pass == 0)
+					hr.histlen += s->len;
+				else
+					handoff_put(o, s->frame, s->len);
+			}
+		handoff_send(fd, &hr, sizeof(hr), NULL, 0);
+		handoff_flush(o);
+	}
+
+	// clients, each with its socket
+	for (int i = 0; i < relay.nshards; i++) {
+		struct conn_table* table = &relay.shards[i].table;
+		for (int j = 0; j < table->nlive; j++) {
+			struct conn* c = table->live[j];
+			struct handoff_conn hc = { c->room, c->drops, c->tat, c->frames, 0, 0 };
+			if (c->part)
+				hc.inlen += c->part->len - c->part_off;
+			for (struct msg* m = c->held; m; m = m->next_free)
+				hc.inlen += m->len;
+			for (unsigned k = 0; k < c->out_count; k++)
+				hc.outlen += c->outq[(c->out_head + k) & (c->out_cap - 1)].len;
+			handoff_send(fd, &hc, sizeof(hc), &c->fd, 1);
+
+			if (c->part)
+				handoff_put(o, c->part->data + c->part_off, c->part->len - c->part_off);
+			for (struct msg* m = c->held; m; m = m->next_free)
+				handoff_put(o, m->data, m->len);
+			for (unsigned k = 0; k < c->out_count; k++) {
+				struct msgref* r = &c->outq[(c->out_head + k) & (c->out_cap - 1)];
+				handoff_put(o, r->m->data + r->off, r->len);
+			}
+			handoff_flush(o);
+		}
+	}
+
+	// the successor starts its own monitor
+	kill(relay.monitor_pid, SIGTERM);
+	exit(0);
+}
+
+/*
+ * handoff_send - send one message on the handoff socket
+ * @param fd - the socket
+ * @param buf - the message
+ * @param len - its bytes
+ * @param fds - fds sent along, NULL for none
+ * @param nfds - # of fds, at most MAX_LISTEN
+ */
+void handoff_send(int fd, const void* buf, int len, const int* fds, int nfds) {
+	struct iovec iov = { (void*) buf, len };
+	struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1 };
+	char cbuf[CMSG_SPACE(MAX_LISTEN * sizeof(int))];
+
+	if (nfds > 0) {
+		mh.msg_control = cbuf;
+		mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		struct cmsghdr* cm = CMSG_FIRSTHDR(&mh);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(cm), fds, nfds * sizeof(int));
+	}
+	if (sendmsg(fd, &mh, MSG_NOSIGNAL) != len)
+		error_exit("sendmsg handoff");
+}
+
+/*
+ * handoff_recv - receive one message from the handoff socket
+ * @param fd - the socket
+ * @param buf - where the message goes
+ * @param len - its room, a longer message is an error
+ * @param fds - set to the fds sent along, the ones past maxfds are closed
+ * @param maxfds - room in fds
+ * @returns bytes of the message, 0 at EOF
+ */
+int handoff_recv(int fd, void* buf, int len, int* fds, int maxfds) {
+	struct iovec iov = { buf, len };
+	char cbuf[CMSG_SPACE(MAX_LISTEN * sizeof(int))];
+	struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+	int n;
+
+	if ((n = recvmsg(fd, &mh, 0)) == -1)
+		error_exit("recvmsg handoff");
+	if (mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+		fprintf(stderr, "bad handoff message\n");
+		exit(1);
+	}
+	for (struct cmsghdr* cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+		if ((cm->cmsg_level != SOL_SOCKET) || (cm->cmsg_type != SCM_RIGHTS))
+			continue;
+		int k = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int), got[MAX_LISTEN];
+		memcpy(got, CMSG_DATA(cm), k * sizeof(int));
+		for (int i = 0; i < k; i++) {
+			if (i < maxfds)
+				fds[i] = got[i];
+			else
+				close(got[i]);
+		}
+	}
+	return n;
+}
+
+// add to a byte string on the handoff socket
+void handoff_put(struct handoff_out* o, const void* buf, size_t len) {
+	while (len > 0) {
+		size_t k = (len < (size_t) (HANDOFF_CHUNK - o->len)) ? len : (size_t) (HANDOFF_CHUNK - o->len);
+		memcpy(o->buf + o->len, buf, k);
+		o->len += k;
+		buf = (const char*) buf + k;
+		len -= k;
+		if (o->len == HANDOFF_CHUNK)
+			handoff_flush(o);
+	}
+}
+
+// end a byte string, the receiver takes exactly its length
+void handoff_flush(struct handoff_out* o) {
+	if (o->len > 0)
+		handoff_send(o->fd, o->buf, o->len, NULL, 0);
+	o->len = 0;
+}
+
+// receive a byte string of len bytes
+void handoff_take(int fd, char* buf, size_t len) {
+	while (len > 0) {
+		int n = handoff_recv(fd, buf, (len < HANDOFF_CHUNK) ? len : HANDOFF_CHUNK, NULL, 0);
+		if (n <= 0) {
+			fprintf(stderr, "handoff cut short\n");
+			exit(1);
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+/*
+ * shard_handoff - stop the shard for a successor, called after every batch once relay.handoff is set
+ * 		 - 1: its clients are no longer read, like throttled ones, and it is quiet
+ * 		   once it has no mail left for a full mailbox
+ * 		 - 2: once every shard is quiet, it broadcasts the mail left for it, flushes,
+ * 		   waits for its io_uring requests to end and parks for handoff_serve()
+ * @param sh - the shard
+ */
+void shard_handoff(struct shard* sh) {
+	struct conn_table* table = &sh->table;
+	struct ureactor* ur = table->ur;
+
+	if (!sh->stopped) {
+		sh->stopped = 1;
+		// waiting for buffers, no recv is armed
+		while (ur && ur->starved) {
+			struct conn* c = ur->starved;
+			ur->starved = c->next_starved;
+			c->ops--;
+			c->reading = 0;
+		}
+		for (int i = 0; i < table->nlive; i++) {
+			struct conn* c = table->live[i];
+			c->throttled = 1;
+			wheel_del(&table->wheel, &c->timer);
+			wheel_del(&table->wheel, &c->idle);
+			if (ur && c->reading)
+				uring_cancel(ur, c, UR_RECV);
+		}
+		for (int i = 0; ur && (i < sh->nlisten); i++)
+			uring_cancel(ur, &sh->listeners[i], UR_ACCEPT);
+	}
+	if (!sh->quiet) {
+		for (int dst = 0; dst < relay.nshards; dst++)
+			if (sh->backlog[dst].n > 0)
+				return;
+		sh->quiet = 1;
+		atomic_fetch_add_explicit(&relay.quiet, 1, memory_order_release);
+	}
+	if (atomic_load_explicit(&relay.handoff, memory_order_acquire) < 2)
+		return;
+
+	shard_recv_mail(sh);
+	table_flush(table);
+	if (ur) {
+		int busy = 0;
+		for (int i = 0; i < table->nlive; i++) {
+			struct conn* c = table->live[i];
+			// once, a SENDMSG waiting on a full socket may never complete
+			if ((sh->stopped == 1) && (c->send_refs > 0))
+				uring_cancel(ur, c, UR_SEND);
+			busy |= (c->ops > 0);
+		}
+		sh->stopped = 2;
+		if (busy)
+			return;
+	}
+	atomic_fetch_add_explicit(&relay.parked, 1, memory_order_release);
+	for (;;)
+		pause();
+}
+
+/*
+ * shard_adopted - relay what the clients taken over had sent, read them from now on,
+ * 		   and send what they had queued, once the shard's reactor is up, -H
+ * @param sh - the shard
+ */
+void shard_adopted(struct shard* sh) {
+	struct conn_table* table = &sh->table;
+
+	if (table->nlive == 0)
+		return;
+	table->now = now_ns();
+	// a slow receiver closed meanwhile moves the last conn into its hole
+	for (int i = table->nlive - 1; i >= 0; i--)
+		if (i < table->nlive)
+			conn_resume(sh, table->live[i]);
+	table_flush(table);
+	shard_send_mail(sh);
+}
+
+// what metrics_write() prints, one line per shard each
+struct metric {
+	const char* name;
+	const char* type;
+	const char* help;
+	size_t off;
+};
+static const struct metric metrics[] = {
+	{ "chat_connections", "gauge", "Clients connected.", offsetof(struct shard_stats, conns) },
+	{ "chat_queued_bytes", "gauge", "Bytes queued for clients, not yet taken by their sockets.", offsetof(struct shard_stats, queued) },
+	{ "chat_mail_backlog", "gauge", "Messages for other shards waiting for room in their mailboxes.", offsetof(struct shard_stats, backlog) },
+	{ "chat_accepted_total", "counter", "Clients accepted.", offsetof(struct shard_stats, accepted) },
+	{ "chat_closed_total", "counter", "Clients gone, for any reason.", offsetof(struct shard_stats, closed) },
+	{ "chat_slow_closed_total", "counter", "Clients hung up on for falling behind.", offsetof(struct shard_stats, slow_closed) },
+	{ "chat_idle_closed_total", "counter", "Clients hung up on for going quiet or leaving their output unread.", offsetof(struct shard_stats, idle_closed) },
+	{ "chat_frames_in_total", "counter", "Frames received from clients.", offsetof(struct shard_stats, frames_in) },
+	{ "chat_bytes_in_total", "counter", "Bytes received from clients.", offsetof(struct shard_stats, bytes_in) },
+	{ "chat_frames_out_total", "counter", "Frames queued for clients.", offsetof(struct shard_stats, frames_out) },
+	{ "chat_bytes_out_total", "counter", "Bytes sent to clients.", offsetof(struct shard_stats, bytes_out) },
+	{ "chat_drops_total", "counter", "Messages dropped for clients over the high-water mark.", offsetof(struct shard_stats, drops) },
+	{ "chat_throttled_total", "counter", "Times a client was stopped for going over its rate or its room's.", offsetof(struct shard_stats, throttled) },
+	{ "chat_broadcasts_total", "counter", "Messages broadcast to the shard's clients in a room.", offsetof(struct shard_stats, broadcasts) },
+	{ "chat_syscalls_total", "counter", "System calls made by the shard's event loop.", offsetof(struct shard_stats, syscalls) },
+};
+
+/*
+ * metrics_init - listen for scrapes on opts.metrics, a loopback port or unix:path,
+ * 		  and answer them from a thread of their own
+ */
+void metrics_init(void) {
+	int fd;
+
+	if (strncmp(opts.metrics, "unix:", 5) == 0) {
+		struct sockaddr_un addr = { .sun_family = AF_UNIX };
+		if (strlen(opts.metrics + 5) >= sizeof(addr.sun_path)) {
+			fprintf(stderr, "-m path too long\n");
+			exit(1);
+		}
+		strcpy(addr.sun_path, opts.metrics + 5);
+		// left behind by an earlier run
+		unlink(addr.sun_path);
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+			error_exit("socket metrics");
+		if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1)
+			error_exit("bind metrics");
+	}
+	else {
+		struct sockaddr_in addr = { .sin_family = AF_INET };
+		int val = 1;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addr.sin_port = htons(atoi(opts.metrics));
+		if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+			error_exit("socket metrics");
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+		if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1)
+			error_exit("bind metrics");
+	}
+	if (listen(fd, 16) == -1)
+		error_exit("listen metrics");
+	relay.metrics_fd = fd;
+
+	pthread_t tid;
+	if ((errno = pthread_create(&tid, NULL, metrics_serve, (void*) (intptr_t) fd)) != 0)
+		error_exit("pthread_create metrics");
+	pthread_detach(tid);
+}
+
+/*
+ * metrics_serve - answer every connection with the metrics as an HTTP response, then hang up
+ * 		 - blocking, one scrape at a time, the request is not looked at
+ * @param arg - the listening fd
+ */
+void* metrics_serve(void* arg) {
+	int lfd = (int) (intptr_t) arg;
+	// a scraper that stops halfway holds up the next scrape, never a shard
+	struct timeval tv = { 1, 0 };
+	char req[1024];
+
+	for (;;) {
+		int fd = accept(lfd, NULL, NULL);
+		if (fd == -1) {
+			if ((errno == EINTR) || (errno == ECONNABORTED))
+				continue;
+			// shut down for the successor
+			if (atomic_load(&relay.handoff))
+				return NULL;
+			error_exit("accept metrics");
+		}
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		if (read(fd, req, sizeof(req)) < 0) {
+			close(fd);
+			continue;
+		}
+
+		char* body;
+		size_t len;
+		FILE* out = open_memstream(&body, &len);
+		if (out == NULL)
+			error_exit("open_memstream");
+		metrics_write(out);
+		fclose(out);
+
+		char hdr[128];
+		int n = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %zu\r\n\r\n", len);
+		if (send(fd, hdr, n, MSG_NOSIGNAL) == n)
+			for (size_t off = 0; off < len; ) {
+				ssize_t k = send(fd, body + off, len - off, MSG_NOSIGNAL);
+				if (k <= 0)
+					break;
+				off += k;
+			}
+		free(body);
+		close(fd);
+	}
+	return NULL;
+}
+
+/*
+ * metrics_write - the counters of every shard in the Prometheus text format
+ * 		 - relaxed loads, a scrape sees each counter at some recent value
+ * @param out - where to print them
+ */
+void metrics_write(FILE* out) {
+	for (size_t k = 0; k < sizeof(metrics) / sizeof(metrics[0]); k++) {
+		fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", metrics[k].name, metrics[k].help, metrics[k].name, metrics[k].type);
+		for (int i = 0; i < relay.nshards; i++) {
+			_Atomic uint64_t* v = (_Atomic uint64_t*) ((char*) &relay.shards[i].table.stats + metrics[k].off);
+			fprintf(out, "%s{shard=\"%d\"} %lu\n", metrics[k].name, i,
+				(unsigned long) atomic_load_explicit(v, memory_order_relaxed));
+		}
+	}
+
+	// the cost of a broadcast, what batching and io_uring bring down
+	fprintf(out, "# HELP chat_syscalls_per_broadcast System calls per message broadcast, since the start.\n"
+		"# TYPE chat_syscalls_per_broadcast gauge\n");
+	for (int i = 0; i < relay.nshards; i++) {
+		struct shard_stats* st = &relay.shards[i].table.stats;
+		uint64_t b = atomic_load_explicit(&st->broadcasts, memory_order_relaxed);
+		uint64_t sc = atomic_load_explicit(&st->syscalls, memory_order_relaxed);
+		fprintf(out, "chat_syscalls_per_broadcast{shard=\"%d\"} %.3f\n", i, b ? (double) sc / b : 0.0);
+	}
+
+	fprintf(out, "# HELP chat_clients Clients connected across all shards.\n# TYPE chat_clients gauge\nchat_clients %d\n",
+		atomic_load_explicit(&relay.nclients, memory_order_relaxed));
+	fprintf(out, "# HELP chat_rooms Rooms created.\n# TYPE chat_rooms gauge\nchat_rooms %d\n",
+		__atomic_load_n(&relay.nrooms, __ATOMIC_RELAXED));
+}
+
+/*
+ * conn_send - queue part of a shared message for one client
+ * 	     - the client goes on table->pending and is flushed after the batch
+ * 	     - over opts.high_water what the socket takes is flushed at once, if still over
+ * 	       the client is disconnected, or with -D the message dropped
+ * @param table - clients currently in the chat
+ * @param c - the receiver
+ * @param m - the message, the queue keeps a reference taken by the caller
+ * @param off - first byte of m to send
+ * @param len - # of bytes to send
+ * @returns 1 if queued, 0 if dropped or the client was closed
+ */
+int conn_send(struct conn_table* table, struct conn* c, struct msg* m, int off, int len) {
+
+	// a burst from one sender can fill the queue before the batch ends, flush early
+	if (c->out_bytes + len > opts.high_water) {
+		conn_flush(table, c);
+		if (c->fd == -1)
+			return 0;
+	}
+
+	// too far behind
+	if (c->out_bytes + len > opts.high_water) {
+		if (opts.drop_slow) {
+			c->drops++;
+			STAT_ADD(&table->stats, drops, 1);
+		}
+		else {
+			STAT_ADD(&table->stats, slow_closed, 1);
+			conn_close(table, c);
+		}
+		return 0;
+	}
+
+	// grow the ring, unwrapping it into the new array
+	if (c->out_count == c->out_cap) {
+		unsigned cap = c->out_cap ? c->out_cap * 2 : 16;
+		struct msgref* q = malloc(cap * sizeof(struct msgref));
+		if (q == NULL)
+			error_exit("malloc outq");
+		for (unsigned i = 0; i < c->out_count; i++)
+			q[i] = c->outq[(c->out_head + i) & (c->out_cap - 1)];
+		free(c->outq);
+		c->outq = q;
+		c->out_head = 0;
+		c->out_cap = cap;
+	}
+
+	// the write-stall clock starts with the first message queued
+	if (c->out_count == 0)
+		c->last_out = table->now / TICK_NS;
+	struct msgref* r = &c->outq[(c->out_head + c->out_count) & (c->out_cap - 1)];
+	r->m = m;
+	r->off = off;
+	r->len = len;
+	c->out_count++;
+	c->out_bytes += len;
+	STAT_ADD(&table->stats, frames_out, 1);
+	STAT_ADD(&table->stats, queued, len);
+
+	if (!c->pending) {
+		c->pending = 1;
+		c->next_pending = table->pending;
+		table->pending = c;
+	}
+	return 1;
+}
+
+/*
+ * conn_flush - writev() queued output until the queue is empty or the socket is full
+ * 	      - with io_uring, submit a SENDMSG instead
+ * @param table - clients currently in the chat
+ * @param c - the client
+ */
+void conn_flush(struct conn_table* table, struct conn* c) {
+	struct iovec iov[FLUSH_IOV];
+	ssize_t sent;
+
+	if (table->ur) {
+		uring_send(table, c);
+		return;
+	}
+
+	while (c->out_count > 0) {
+		int n = 0;
+		size_t total = 0;
+		for (unsigned i = 0; (i < c->out_count) && (n < FLUSH_IOV); i++, n++) {
+			struct msgref* r = &c->outq[(c->out_head + i) & (c->out_cap - 1)];
+			iov[n].iov_base = r->m->data + r->off;
+			iov[n].iov_len = r->len;
+			total += r->len;
+		}
+
+		STAT_ADD(&table->stats, syscalls, 1);
+		if ((sent = writev(c->fd, iov, n)) == -1) {
+			// the next EPOLLOUT edge continues from here
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				return;
+			// the receiver is gone
+			conn_close(table, c);
+			return;
+		}
+		conn_sent(table, c, sent);
+
+		// partial write, the socket is full
+		if ((size_t) sent < total)
+			return;
+	}
+	if (c->closing)
+		conn_close(table, c);
+}
+
+/*
+ * conn_sent - release the messages the socket took, the first partly sent one keeps its place
+ * 	     - neighbours in the same buffer are released with one atomic op
+ * @param table - clients currently in the chat
+ * @param c - the client
+ * @param sent - # of bytes written from the head of the queue
+ */
+void conn_sent(struct conn_table* table, struct conn* c, size_t sent) {
+	struct msg* done = NULL;
+	int ndone = 0;
+
+	if (sent > 0)
+		c->last_out = table->now / TICK_NS;
+	c->out_bytes -= sent;
+	STAT_ADD(&table->stats, bytes_out, sent);
+	STAT_ADD(&table->stats, queued, -sent);
+	while (sent > 0) {
+		struct msgref* r = &c->outq[c->out_head];
+		if (sent < (size_t) r->len) {
+			r->off += sent;
+			r->len -= sent;
+			break;
+		}
+		sent -= r->len;
+		if (r->m != done) {
+			if (done)
+				msg_put(table, done, ndone);
+			done = r->m;
+			ndone = 0;
+		}
+		ndone++;
+		c->out_head = (c->out_head + 1) & (c->out_cap - 1);
+		c->out_count--;
+	}
+	if (done)
+		msg_put(table, done, ndone);
+}
+
+/*
+ * conn_drop - release queued messages without sending them
+ * @param table - clients currently in the chat
+ * @param c - the client
+ * @param keep - # of messages at the head to keep, those of a send in flight
+ */
+void conn_drop(struct conn_table* table, struct conn* c, unsigned keep) {
+	while (c->out_count > keep) {
+		c->out_count--;
+		msg_put(table, c->outq[(c->out_head + c->out_count) & (c->out_cap - 1)].m, 1);
+	}
+	STAT_ADD(&table->stats, queued, -c->out_bytes);
+	c->out_bytes = 0;
+}
+
+/*
+ * table_flush - flush every client that had output queued during the batch
+ * @param table - clients currently in the chat
+ */
+void table_flush(struct conn_table* table) {
+	while (table->pending) {
+		struct conn* c = table->pending;
+		table->pending = c->next_pending;
+		c->pending = 0;
+		// closed earlier in this batch
+		if (c->fd != -1)
+			conn_flush(table, c);
+	}
+}
+
+/*
+ * msg_get - take a message buffer from the pool
+ * @param table - owner of the pool
+ * @returns a message with one reference, held by the caller
+ */
+struct msg* msg_get(struct conn_table* table) {
+	// take back everything other shards released
+	if (table->pool == NULL)
+		table_reclaim(table);
+
+	struct msg* m = table->pool;
+	if (m)
+		table->pool = m->next_free;
+	else if ((m = malloc(sizeof(struct msg) + MSG_SIZE)) == NULL)
+		error_exit("malloc msg");
+	atomic_store_explicit(&m->refs, 1, memory_order_relaxed);
+	m->len = 0;
+	m->owner = table;
+	m->bid = -1;
+	return m;
+}
+
+/*
+ * msg_put - drop references, the last one returns the buffer to its owner's pool
+ * @param table - table of the calling shard
+ * @param m - the message
+ * @param n - # of references to drop
+ */
+void msg_put(struct conn_table* table, struct msg* m, int n) {
+	if ((n == 0) || (atomic_fetch_sub_explicit(&m->refs, n, memory_order_acq_rel) != n))
+		return;
+
+	struct conn_table* owner = m->owner;
+	if (owner == table) {
+		msg_free(table, m);
+		return;
+	}
+
+	// the owner takes the whole stack at once, so there is no ABA on pop
+	struct msg* head = atomic_load_explicit(&owner->remote_free, memory_order_relaxed);
+	do {
+		m->next_free = head;
+	} while (!atomic_compare_exchange_weak_explicit(&owner->remote_free, &head, m,
+			memory_order_release, memory_order_relaxed));
+}
+
+/*
+ * msg_free - return an unreferenced msg to the pool, or a provided buffer to the kernel
+ * @param table - owner of the msg
+ * @param m - the message
+ */
+void msg_free(struct conn_table* table, struct msg* m) {
+	if (m->bid >= 0) {
+		// the kernel's reference, dropped by whoever takes it from a recv CQE
+		atomic_store_explicit(&m->refs, 1, memory_order_relaxed);
+		uring_bufs_add(&table->ur->bufs, m->data, UBUF_SIZE, m->bid);
+		table->ur->recycled++;
+		return;
+	}
+	m->next_free = table->pool;
+	table->pool = m;
+}
+
+/*
+ * table_reclaim - take back the msgs other shards released
+ * @param table - owner of the msgs
+ */
+void table_reclaim(struct conn_table* table) {
+	struct msg* m = atomic_exchange_explicit(&table->remote_free, NULL, memory_order_acquire);
+	while (m) {
+		struct msg* next = m->next_free;
+		msg_free(table, m);
+		m = next;
+	}
+}
+
+/*
+ * rx_buf - the buffer to receive into, replaced once nearly full
+ * 	  - small messages share a buffer instead of pinning one each while queued
+ * @param table - owner of the pool
+ * @returns table->rx, with at least MSG_MIN bytes free after m->len
+ */
+struct msg* rx_buf(struct conn_table* table) {
+	if ((table->rx == NULL) || (MSG_SIZE - table->rx->len < MSG_MIN)) {
+		if (table->rx)
+			msg_put(table, table->rx, 1);
+		table->rx = msg_get(table);
+	}
+	return table->rx;
+}
+
+/*
+ * table_init - make an empty connection table
+ * @param table - the table
+ */
+void table_init(struct conn_table* table) {
+	memset(table, 0, sizeof(*table));
+	if ((table->members = calloc(MAX_ROOMS, sizeof(struct members))) == NULL)
+		error_exit("calloc members");
+	if ((table->spare_fd = open("/dev/null", O_RDONLY)) == -1)
+		error_exit("open spare fd");
+	table->now = now_ns();
+	wheel_init(&table->wheel, table->now / TICK_NS);
+}
+
+/*
+ * conn_alloc - take a conn off the free list, adding a slab if it is empty
+ * @param table - the table
+ * @param fd - the client's fd
+ * @returns the conn, already in table->live
+ */
+struct conn* conn_alloc(struct conn_table* table, int fd) {
+	if (table->free == NULL) {
+		if (table->nslabs == table->maxslabs) {
+			table->maxslabs = table->maxslabs ? table->maxslabs * 2 : 8;
+			if ((table->slabs = realloc(table->slabs, table->maxslabs * sizeof(struct conn*))) == NULL)
+				error_exit("realloc slabs");
+		}
+		struct conn* slab = calloc(CONN_SLAB, sizeof(struct conn));
+		if (slab == NULL)
+			error_exit("calloc slab");
+		table->slabs[table->nslabs++] = slab;
+		for (int i = CONN_SLAB - 1; i >= 0; i--) {
+			slab[i].next_free = table->free;
+			table->free = &slab[i];
+		}
+	}
+
+	if (table->nlive == table->maxlive) {
+		table->maxlive = table->maxlive ? table->maxlive * 2 : CONN_SLAB;
+		if ((table->live = realloc(table->live, table->maxlive * sizeof(struct conn*))) == NULL)
+			error_exit("realloc live");
+	}
+
+	struct conn* c = table->free;
+	table->free = c->next_free;
+	c->next_free = NULL;
+	c->kind = CONN_CLIENT;
+	c->fd = fd;
+	c->live_i = table->nlive;
+	table->live[table->nlive++] = c;
+	room_join(table, c, 0);
+
+	STAT_ADD(&table->stats, conns, 1);
+
+	// the idle timer checks on it once it is quiet, or its output stalls, for -I
+	c->last_in = c->last_out = table->now / TICK_NS;
+	c->pinged = 0;
+	c->timer.kind = TIMER_THROTTLE;
+	c->idle.kind = TIMER_IDLE;
+	if (opts.idle_ticks)
+		wheel_add(&table->wheel, &c->idle, c->last_in + opts.idle_ticks);
+	return c;
+}
+
+/*
+ * conn_close - hang up on a client and remove it from table->live
+ * 	      - the conn stays off the free list until table_reap(),
+ * 	        events of the current batch may still point at it
+ * @param table - the table
+ * @param c - the conn
+ */
+void conn_close(struct conn_table* table, struct conn* c) {
+	// close() also removes it from the epoll set,
+	// io_uring requests hold the socket open, shutdown() ends them
+	if (table->ur)
+		shutdown(c->fd, SHUT_RDWR);
+	close(c->fd);
+	c->fd = -1;
+
+	// move the last live conn into the hole
+	struct conn* last = table->live[--table->nlive];
+	table->live[c->live_i] = last;
+	last->live_i = c->live_i;
+	if (!c->closing)
+		room_leave(table, c);
+
+	atomic_fetch_sub_explicit(&relay.nclients, 1, memory_order_relaxed);
+	STAT_ADD(&table->stats, conns, -1);
+	STAT_ADD(&table->stats, closed, 1);
+
+	// drop queued output, but what a SENDMSG in flight still reads
+	conn_drop(table, c, c->send_refs);
+	if (c->part) {
+		msg_put(table, c->part, 1);
+		c->part = NULL;
+	}
+	c->drops = 0;
+	c->frames = 0;
+	wheel_del(&table->wheel, &c->timer);
+	wheel_del(&table->wheel, &c->idle);
+	c->throttled = 0;
+	c->closing = 0;
+	c->tat = 0;
+	while (c->held) {
+		struct msg* m = c->held;
+		c->held = m->next_free;
+		msg_put(table, m, 1);
+	}
+	c->held_tail = NULL;
+
+	c->next_free = table->closed;
+	table->closed = c;
+}
+
+/*
+ * conn_eof - the client sent EOF, hang up once what is queued for it is sent
+ * 	    - it leaves its room at once, so the queue only gets shorter,
+ * 	      a client that stops reading is still hung up on by -I
+ * @param table - the table
+ * @param c - the conn
+ */
+void conn_eof(struct conn_table* table, struct conn* c) {
+	if (c->out_count == 0) {
+		conn_close(table, c);
+		return;
+	}
+	room_leave(table, c);
+	c->closing = 1;
+}
+
+/*
+ * table_reap - put the conns closed during the last batch back on the free list
+ * 	      - with io_uring, once their requests in flight have completed
+ * @param table - the table
+ */
+void table_reap(struct conn_table* table) {
+	struct conn** pp = &table->closed;
+	while (*pp) {
+		struct conn* c = *pp;
+		// a CQE still to come points at it
+		if (c->ops > 0) {
+			pp = &c->next_free;
+			continue;
+		}
+		*pp = c->next_free;
+		c->next_free = table->free;
+		table->free = c;
+	}
+}
+
+/*
+ * watch - add an fd to the epoll set, edge-triggered
+ * @param epfd - epoll instance
+ * @param c - state of the fd, returned in epoll_event.data.ptr
+ */
+void watch(int epfd, struct conn* c) {
+	struct epoll_event ev;
+	// EPOLLOUT only fires when a full socket buffer drains, when edge-triggered
+	ev.events = EPOLLIN | EPOLLET | ((c->kind == CONN_CLIENT) ? EPOLLOUT : 0);
+	ev.data.ptr = c;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev) == -1)
+		error_exit("epoll_ctl");
+}
+
+/*
+ * set_nonblock - make an fd non-blocking
+ * @param fd - the fd
+ */
+void set_nonblock(int fd) {
+	int flags = fcntl(fd, F_GETFL, 0);
+	if ((flags == -1) || (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1))
+		error_exit("fcntl");
 }
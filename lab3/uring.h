@@ -0,0 +1,198 @@
+/*
+ * uring.h - the little of io_uring server.c needs, on raw syscalls
+ * 	   - one submission and one completion ring, plus provided buffer rings
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// an io_uring instance and its mapped rings
+struct uring {
+	int fd;
+	// mappings, for uring_exit()
+	void* rings;
+	size_t rings_len, sqes_len;
+	// submission queue
+	unsigned *sq_head, *sq_tail, *sq_array;
+	unsigned sq_mask, sq_entries;
+	struct io_uring_sqe* sqes;
+	// SQEs filled since the last uring_enter()
+	unsigned to_submit;
+	// completion queue
+	unsigned *cq_head, *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe* cqes;
+};
+
+// provided buffers the kernel picks from for a recv, one group
+struct uring_bufs {
+	struct io_uring_buf_ring* br;
+	unsigned mask;
+	// local copy of br->tail, published by uring_bufs_commit()
+	unsigned short tail;
+};
+
+/*
+ * uring_init - set up an io_uring and map its rings
+ * @param u - the ring
+ * @param entries - SQ size, the CQ is four times as large
+ * @returns 0, or -errno when io_uring is unavailable
+ */
+static inline int uring_init(struct uring* u, unsigned entries) {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	memset(u, 0, sizeof(*u));
+	// one thread per ring, completions are only reaped in uring_enter()
+	p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+	p.cq_entries = entries * 4;
+
+	if ((u->fd = syscall(__NR_io_uring_setup, entries, &p)) == -1)
+		return -errno;
+
+	// FEAT_SINGLE_MMAP, since 5.4: SQ and CQ rings share one mapping
+	size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	size_t len = (sq_len > cq_len) ? sq_len : cq_len;
+	char* rings = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (rings == MAP_FAILED)
+		return -errno;
+	u->rings = rings;
+	u->rings_len = len;
+	u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		return -errno;
+
+	u->sq_head = (unsigned*) (rings + p.sq_off.head);
+	u->sq_tail = (unsigned*) (rings + p.sq_off.tail);
+	u->sq_array = (unsigned*) (rings + p.sq_off.array);
+	u->sq_mask = *(unsigned*) (rings + p.sq_off.ring_mask);
+	u->sq_entries = p.sq_entries;
+	u->cq_head = (unsigned*) (rings + p.cq_off.head);
+	u->cq_tail = (unsigned*) (rings + p.cq_off.tail);
+	u->cq_mask = *(unsigned*) (rings + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe*) (rings + p.cq_off.cqes);
+
+	// SQE i always sits in slot i
+	for (unsigned i = 0; i < p.sq_entries; i++)
+		u->sq_array[i] = i;
+	return 0;
+}
+
+/*
+ * uring_exit - unmap the rings and close the io_uring
+ * @param u - the ring
+ */
+static inline void uring_exit(struct uring* u) {
+	munmap(u->sqes, u->sqes_len);
+	munmap(u->rings, u->rings_len);
+	close(u->fd);
+}
+
+/*
+ * uring_enter - submit the SQEs filled so far and wait for completions
+ * @param u - the ring
+ * @param wait - # of completions to wait for, 0 to only submit
+ * @returns 0, or -errno
+ */
+static inline int uring_enter(struct uring* u, unsigned wait) {
+	unsigned n = u->to_submit;
+	if ((n == 0) && (wait == 0))
+		return 0;
+	u->to_submit = 0;
+	if (syscall(__NR_io_uring_enter, u->fd, n, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0) == -1)
+		return -errno;
+	return 0;
+}
+
+/*
+ * uring_sqe - a zeroed SQE to fill, submitting first if the SQ is full
+ * @param u - the ring
+ * @returns the SQE, queued for the next uring_enter()
+ */
+static inline struct io_uring_sqe* uring_sqe(struct uring* u) {
+	unsigned tail = *u->sq_tail;
+	if (tail - atomic_load_explicit((_Atomic unsigned*) u->sq_head, memory_order_acquire) == u->sq_entries) {
+		uring_enter(u, 0);
+		tail = *u->sq_tail;
+	}
+	struct io_uring_sqe* sqe = &u->sqes[tail & u->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	// the kernel only reads it once the tail moves past it, in uring_enter()
+	atomic_store_explicit((_Atomic unsigned*) u->sq_tail, tail + 1, memory_order_release);
+	u->to_submit++;
+	return sqe;
+}
+
+/*
+ * uring_cqe - the oldest unseen completion
+ * @param u - the ring
+ * @returns the CQE, NULL if there is none, release it with uring_cqe_seen()
+ */
+static inline struct io_uring_cqe* uring_cqe(struct uring* u) {
+	unsigned head = *u->cq_head;
+	if (head == atomic_load_explicit((_Atomic unsigned*) u->cq_tail, memory_order_acquire))
+		return NULL;
+	return &u->cqes[head & u->cq_mask];
+}
+
+static inline void uring_cqe_seen(struct uring* u) {
+	atomic_store_explicit((_Atomic unsigned*) u->cq_head, *u->cq_head + 1, memory_order_release);
+}
+
+/*
+ * uring_bufs_init - register an empty provided buffer ring
+ * @param u - the ring
+ * @param b - the buffer ring
+ * @param entries - # of buffers it holds, a power of 2
+ * @param bgid - buffer group the recv SQEs select from
+ * @returns 0, or -errno
+ */
+static inline int uring_bufs_init(struct uring* u, struct uring_bufs* b, unsigned entries, int bgid) {
+	struct io_uring_buf_reg reg;
+	size_t len = entries * sizeof(struct io_uring_buf);
+
+	b->br = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (b->br == MAP_FAILED)
+		return -errno;
+	b->mask = entries - 1;
+	b->tail = 0;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t) (uintptr_t) b->br;
+	reg.ring_entries = entries;
+	reg.bgid = bgid;
+	if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+		return -errno;
+	return 0;
+}
+
+/*
+ * uring_bufs_add - hand a buffer to the kernel, visible after uring_bufs_commit()
+ * @param b - the buffer ring
+ * @param addr - the buffer
+ * @param len - its size
+ * @param bid - id returned in the CQE flags of the recv that fills it
+ */
+static inline void uring_bufs_add(struct uring_bufs* b, void* addr, unsigned len, unsigned short bid) {
+	struct io_uring_buf* buf = &b->br->bufs[b->tail & b->mask];
+	buf->addr = (uint64_t) (uintptr_t) addr;
+	buf->len = len;
+	buf->bid = bid;
+	b->tail++;
+}
+
+static inline void uring_bufs_commit(struct uring_bufs* b) {
+	atomic_store_explicit((_Atomic unsigned short*) &b->br->tail, b->tail, memory_order_release);
+}
+
+#endif
@@ -0,0 +1,173 @@
+/*
+ * wheel.h - a hierarchical timing wheel, the timers of one thread coalesced into one timeout
+ * 	   - arming and cancelling are O(1), each tick only looks at its own slot
+ * 	   - a timer further out than a level's slots cover waits in a coarser level,
+ * 	     and moves down a level each time the finer one wraps around to it
+ * 	   - timers are nodes embedded in their owner, expired ones are handed back as a list
+ */
+
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// slots of a level are 1 << WHEEL_BITS ticks apart on the level below,
+// 4 levels of 64 reach 2^24 ticks, further out waits in the last level
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+// a timer, in a slot's list while armed
+struct wheel_node {
+	struct wheel_node *next, *prev;
+	// tick it expires at
+	uint64_t expires;
+	// what the owner armed it for, the wheel does not look at it
+	int kind;
+};
+
+struct wheel {
+	// last tick expired
+	uint64_t tick;
+	// timers armed
+	unsigned count;
+	// list heads, level 0 a slot per tick
+	struct wheel_node slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+/*
+ * wheel_init - an empty wheel
+ * @param w - the wheel
+ * @param now - the current tick
+ */
+static inline void wheel_init(struct wheel* w, uint64_t now) {
+	w->tick = now;
+	w->count = 0;
+	for (int l = 0; l < WHEEL_LEVELS; l++)
+		for (int i = 0; i < WHEEL_SLOTS; i++)
+			w->slots[l][i].next = w->slots[l][i].prev = &w->slots[l][i];
+}
+
+static inline int wheel_armed(const struct wheel_node* n) {
+	return n->prev != NULL;
+}
+
+static inline void wheel_del(struct wheel* w, struct wheel_node* n) {
+	if (!wheel_armed(n))
+		return;
+	n->prev->next = n->next;
+	n->next->prev = n->prev;
+	n->next = n->prev = NULL;
+	w->count--;
+}
+
+// put n in the slot of the finest level that reaches n->expires from w->tick
+static inline void wheel_link(struct wheel* w, struct wheel_node* n) {
+	uint64_t delta = n->expires - w->tick, at = n->expires;
+	int l = 0;
+	while ((l < WHEEL_LEVELS - 1) && (delta >= (uint64_t) WHEEL_SLOTS << (l * WHEEL_BITS)))
+		l++;
+	// too far for the last level, it comes back around and is placed again
+	if (delta >= (uint64_t) WHEEL_SLOTS << (l * WHEEL_BITS))
+		at = w->tick + ((uint64_t) WHEEL_SLOTS << (l * WHEEL_BITS)) - 1;
+
+	struct wheel_node* head = &w->slots[l][(at >> (l * WHEEL_BITS)) & (WHEEL_SLOTS - 1)];
+	n->next = head->next;
+	n->prev = head;
+	head->next->prev = n;
+	head->next = n;
+}
+
+/*
+ * wheel_add - arm a timer, or move it if it is armed
+ * @param w - the wheel
+ * @param n - the timer
+ * @param expires - tick it expires at, the next tick if that has passed
+ */
+static inline void wheel_add(struct wheel* w, struct wheel_node* n, uint64_t expires) {
+	wheel_del(w, n);
+	if (expires <= w->tick)
+		expires = w->tick + 1;
+	n->expires = expires;
+	wheel_link(w, n);
+	w->count++;
+}
+
+// move the timers of slot i of level l down, w->tick is the tick it is reached at
+static inline void wheel_cascade(struct wheel* w, int l, int i) {
+	struct wheel_node* head = &w->slots[l][i];
+	struct wheel_node* n = head->next;
+	head->next = head->prev = head;
+	while (n != head) {
+		struct wheel_node* next = n->next;
+		wheel_link(w, n);
+		n = next;
+	}
+}
+
+/*
+ * wheel_expire - disarm the timers that expired up to now
+ * @param w - the wheel
+ * @param now - the current tick
+ * @returns the expired timers, linked through next
+ */
+static inline struct wheel_node* wheel_expire(struct wheel* w, uint64_t now) {
+	struct wheel_node* fired = NULL;
+
+	while ((w->count > 0) && (w->tick < now)) {
+		uint64_t t = ++w->tick;
+		// every level whose slot below wrapped around, coarsest first
+		int l = 0;
+		while ((l < WHEEL_LEVELS - 1) && (((t >> (l * WHEEL_BITS)) & (WHEEL_SLOTS - 1)) == 0))
+			l++;
+		for (; l > 0; l--)
+			wheel_cascade(w, l, (t >> (l * WHEEL_BITS)) & (WHEEL_SLOTS - 1));
+
+		struct wheel_node* head = &w->slots[0][t & (WHEEL_SLOTS - 1)];
+		while (head->next != head) {
+			struct wheel_node* n = head->next;
+			wheel_del(w, n);
+			n->next = fired;
+			fired = n;
+		}
+	}
+	w->tick = now;
+	return fired;
+}
+
+/*
+ * wheel_next - ticks until the next timer expires, or the next coarser slot moves down
+ * @param w - the wheel
+ * @returns at least 1, at most INT_MAX, -1 if no timer is armed
+ */
+static inline int wheel_next(const struct wheel* w) {
+	if (w->count == 0)
+		return -1;
+	uint64_t next = UINT64_MAX;
+	for (int i = 1; i < WHEEL_SLOTS; i++) {
+		const struct wheel_node* head = &w->slots[0][(w->tick + i) & (WHEEL_SLOTS - 1)];
+		if (head->next != head) {
+			next = w->tick + i;
+			break;
+		}
+	}
+	// or the first tick a non-empty slot of a coarser level is reached, sooner
+	for (int l = 1; l < WHEEL_LEVELS; l++) {
+		int shift = l * WHEEL_BITS;
+		uint64_t t = ((w->tick >> shift) + 1) << shift;
+		for (int i = 0; (i < WHEEL_SLOTS) && (t < next); i++, t += (uint64_t) 1 << shift) {
+			const struct wheel_node* head = &w->slots[l][(t >> shift) & (WHEEL_SLOTS - 1)];
+			if (head->next != head) {
+				next = t;
+				break;
+			}
+		}
+	}
+	if (next - w->tick > INT_MAX)
+		return INT_MAX;
+	return next - w->tick;
+}
+
+#endif
@@ -4,30 +4,54 @@
  */
 
 #include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 
 #define MAXPAGES 1024
 #define MAXPROC 10
 
+// spatial sampling modulus, a page is kept if hash mod SAMPLE_MOD < threshold
+#define SAMPLE_MOD (1u << 24)
+
+// checkpoint file, written to CKPT_TMP first and renamed when complete
+#define CKPT_FILE "checkpoint.bin"
+#define CKPT_TMP "checkpoint.tmp"
+#define CKPT_VERSION 3
+
+// latency classes of an access, a fault that evicts a dirty page also pays a write-back
+#define LAT_HIT 0
+#define LAT_MINOR 1
+#define LAT_MAJOR 2
+#define LAT_MINOR_WB 3
+#define LAT_MAJOR_WB 4
+#define LAT_CLASSES 5
+
 // AllocEq = 0, AllocProp = 1
 // effective for indexing
 // define variable type as alloc_t to use it
 typedef enum { AllocEq, AllocProp } alloc_t;
-typedef enum { EvictFIFO, EvictSecond, EvictLRU, EvictLFU } evict_t;
+typedef enum { EvictFIFO, EvictSecond, EvictLRU, EvictLFU, EvictESC } evict_t;
 typedef enum { ReplacementGlobal, ReplacementLocal } local_t;
 
 struct access_s {
 	int pid;
 	int addr;
+	// 1 for a write, optional third column of ptrace.txt (R or W)
+	int write;
 };
 typedef struct access_s access_t;
 
 // page table entry
 struct PTE {
 	int present, refer, frame, addts, refts, count;
+	// written since it was loaded, eviction has to write it back
+	int dirty;
 };
 
 // process control block
@@ -37,6 +61,10 @@ struct PCB {
 	// # pages, # frames, # pages, # pages mapped, # frames loaded
 	int num_page, num_frame, page_mapped, frame_loaded;
 	int faults, access;
+	// accesses per latency class, see the cost model in main()
+	int lat[LAT_CLASSES];
+	// dirty pages of this process written back on eviction
+	int writebacks;
 };
 
 // fifo queue entry
@@ -45,11 +73,54 @@ struct FIFOentry {
 	int proc_i;
 };
 
+// checkpoint header
+// followed by, for each process, the PCB fields after PT and its mapped PTEs,
+// then the FIFO as (proc_i, page) pairs
+struct ckpt_s {
+	char magic[4];
+	int version;
+	// run configuration, must match when resuming
+	int memsize, pagesize, alloc, evict, replacement, period;
+	double rate;
+	int nproc, count, naccess;
+	// next trace index to simulate
+	int ts;
+	int FIFOsize;
+	// length of ptable.txt at the checkpoint
+	long ptable_len;
+};
+
+// trace loop state
+struct sim_s {
+	struct PCB *p_dir;
+	struct FIFOentry *FIFO;
+	int FIFOsize;
+	access_t *trace;
+	int nproc, naccess, period;
+	// second chance reference bits are cleared every refreset accesses
+	int refreset;
+	FILE *outfp;
+	// checkpoint every ckpt_period accesses, 0 for never
+	int ckpt_period;
+	struct ckpt_s *ckpt;
+	// pid of the child still writing the last checkpoint, 0 if none
+	pid_t ckpt_child;
+};
+
+int clearPTE(struct PCB *owner, struct PTE *pte);
 int evictPage(struct PCB p_dir[], struct FIFOentry FIFO[], int proc_i, int FIFOsize, int naccess, evict_t e, local_t r);
 int evictFIFO(struct PCB p_dir[], struct FIFOentry FIFO[], int proc_i, int FIFOsize, int naccess, local_t replace);
 int evictSecond(struct PCB p_dir[], struct FIFOentry FIFO[], int proc_i, int FIFOsize, int naccess, local_t replace);
 int evictLRU(struct PCB p_dir[], struct FIFOentry FIFO[], int proc_i, int FIFOsize, int naccess, local_t replace);
 int evictLFU(struct PCB p_dir[], struct FIFOentry FIFO[], int proc_i, int FIFOsize, int naccess, local_t replace);
+int evictESC(struct PCB p_dir[], struct FIFOentry FIFO[], int proc_i, int FIFOsize, int naccess, local_t replace);
+void printPTable(FILE *outfp, struct PCB p_dir[], int nproc, int ts);
+void printLatency(int proc_i, const int lat[], const long cost[], double rate);
+int sampleKeep(int pid, int addr, unsigned threshold);
+int checkpointSave(const struct ckpt_s *hdr, struct PCB p_dir[], struct FIFOentry FIFO[]);
+int checkpointLoad(struct ckpt_s *hdr, struct PCB p_dir[], struct FIFOentry FIFO[]);
+void checkpointStart(struct sim_s *sim, int ts);
+void simulate(struct sim_s *sim, int start, evict_t evict, local_t replacement);
 
 /*
  * main
@@ -62,12 +133,65 @@ int main(int argc, char **argv) {
 	evict_t evict;
 	local_t replacement;
 	access_t  *trace;
-	int pid, msize, addr, count = 0;
+	int pid, msize, count = 0;
 	char ch;
+	int opt, ckpt_period = 0, resume = 0;
+	double rate = 1.0;
+	// cost model in ns, indexed by latency class
+	long cost[LAT_CLASSES];
+	long hit_cost = 100, minor_cost = 2000, major_cost = 100000, wb_cost = 100000;
+
+	// optional flags come before the positional arguments
+	while ((opt = getopt(argc, argv, "s:c:rH:m:M:W:")) != -1) {
+		switch (opt) {
+			case 'H':
+				hit_cost = atol(optarg);
+				break;
+			case 'm':
+				minor_cost = atol(optarg);
+				break;
+			case 'M':
+				major_cost = atol(optarg);
+				break;
+			case 'W':
+				wb_cost = atol(optarg);
+				break;
+			case 'c':
+				ckpt_period = atoi(optarg);
+				if (ckpt_period <= 0) {
+					fprintf(stderr, "checkpoint period must be positive\n");
+					exit(1);
+				}
+				break;
+			case 'r':
+				resume = 1;
+				break;
+			case 's':
+				rate = atof(optarg);
+				if ((rate <= 0.0) || (rate > 1.0)) {
+					fprintf(stderr, "sampling rate must be in (0, 1]\n");
+					exit(1);
+				}
+				break;
+			default:
+				// getopt() already printed the error
+				argc = 0;
+				break;
+		}
+	}
 
-	if (argc != 7) {
+	if (argc - optind != 6) {
 		// printf == fprint(stdout, "")
-		fprintf(stderr, "usage: %s [memsize] [pagesize] [alloc] [eviction] [replacement] [period]\n", argv[0]);
+		fprintf(stderr, "usage: %s [-s rate] [-c n] [-r] [-H ns] [-m ns] [-M ns] [-W ns] [memsize] [pagesize] [alloc] [eviction] [replacement] [period]\n", argv[0]);
+		fprintf(stderr, "      -s rate  - simulate only this fraction of pages (SHARDS-style spatial\n");
+		fprintf(stderr, "                 sampling), frames are scaled down and faults scaled up by it\n");
+		fprintf(stderr, "      -c n     - write %s every n accesses from a forked child\n", CKPT_FILE);
+		fprintf(stderr, "      -r       - resume from %s, arguments must match the checkpointed run\n", CKPT_FILE);
+		fprintf(stderr, "      -H ns    - cost of a hit (default %ld)\n", hit_cost);
+		fprintf(stderr, "      -m ns    - cost of a minor fault, first touch of a page (default %ld)\n", minor_cost);
+		fprintf(stderr, "      -M ns    - cost of a major fault, page read back in (default %ld)\n", major_cost);
+		fprintf(stderr, "      -W ns    - cost of writing back a dirty victim (default %ld)\n", wb_cost);
+		fprintf(stderr, "                 ptrace.txt lines are pid addr [R|W], writes dirty the page\n");
 		fprintf(stderr, "      memsize  - size of physical memory in bytes\n");
 		fprintf(stderr, "      pagesize - size of pages/frames in bytes \n");
 		fprintf(stderr, "      alloc:\n");
@@ -78,6 +202,7 @@ int main(int argc, char **argv) {
 		fprintf(stderr, "          1 - second chance replacement:\n");
 		fprintf(stderr, "          2 - LRU replacement\n");
 		fprintf(stderr, "          3 - LFU replacement\n");
+		fprintf(stderr, "          4 - enhanced second chance (refbit, dirty) replacement\n");
 		fprintf(stderr, "      replacement:\n");
 		fprintf(stderr, "          0 - global replacement\n");
 		fprintf(stderr, "          1 - local replacement\n");
@@ -85,6 +210,7 @@ int main(int argc, char **argv) {
 	}
 
 	// process command-line args
+	argv += optind - 1;
 	memsize  = atoi(argv[1]);
 	pagesize = atoi(argv[2]);
 	period   = atoi(argv[6]);
@@ -117,8 +243,11 @@ int main(int argc, char **argv) {
 		case 3:
 			evict = EvictLFU;
 			break;
+		case 4:
+			evict = EvictESC;
+			break;
 		default:
-			fprintf(stderr, "allocation algorithm must be 0 (FIFO) or 1 (second) or 2 (LRU) or 3 (LFU)\n");
+			fprintf(stderr, "allocation algorithm must be 0 (FIFO) or 1 (second) or 2 (LRU) or 3 (LFU) or 4 (ESC)\n");
 			exit(1);
 			break;
 	}
@@ -158,6 +287,8 @@ int main(int argc, char **argv) {
 		p_dir[i].proc_size = msize;
 		p_dir[i].pid = pid;
 		p_dir[i].frame_loaded = p_dir[i].page_mapped = p_dir[i].faults = p_dir[i].access = 0;
+		memset(p_dir[i].lat, 0, sizeof(p_dir[i].lat));
+		p_dir[i].writebacks = 0;
 
 		p_dir[i].num_page = msize / pagesize;
 		if ((msize % pagesize) != 0) {
@@ -200,6 +331,15 @@ int main(int argc, char **argv) {
 		}
 	}
 
+	// a sampled run simulates a memory scaled down by the same rate,
+	// so each process keeps the same share of frames per sampled page
+	if (rate < 1.0) {
+		for (int i = 0; i < nproc; i++) {
+			p_dir[i].num_frame = (int)(p_dir[i].num_frame * rate + 0.5);
+			if (p_dir[i].num_frame == 0)
+				p_dir[i].num_frame = 1;
+		}
+	}
 
 	ptrace = fopen("ptrace.txt", "r");
 	if (!ptrace) {
@@ -223,153 +363,108 @@ int main(int argc, char **argv) {
 		exit(1);
 	}
 
+	// only the accesses to sampled pages are kept
+	unsigned threshold = (unsigned)(rate * SAMPLE_MOD);
+	naccess = 0;
+	char line[128], rw;
 	for (int cur = 0; cur < count; cur++) {
-		fscanf(ptrace, "%d %d", &trace[cur].pid, &trace[cur].addr);
+		// pid addr [R|W], an access without the third column is a read
+		if (!fgets(line, sizeof(line), ptrace))
+			break;
+		rw = 'R';
+		if (sscanf(line, "%d %d %c", &trace[naccess].pid, &trace[naccess].addr, &rw) < 2)
+			continue;
+		trace[naccess].write = (rw == 'W') || (rw == 'w') || (rw == '1');
+		if ((rate == 1.0) || sampleKeep(trace[naccess].pid, trace[naccess].addr, threshold))
+			naccess++;
 	}
 
 	fclose(ptrace);
 
+	// second chance reference bits are cleared every 100 accesses of the full trace
+	int refreset = (int)(100 * rate + 0.5);
+	if (refreset == 0)
+		refreset = 1;
+
 	if (period == 0) {
 		outfp = NULL;
 	}
 	else {
 		// w == O_WRONLY | O_TRUNC | O_CREATE
-		outfp = fopen("ptable.txt", "w");
+		// a resumed run keeps the snapshots written before the checkpoint
+		outfp = fopen("ptable.txt", resume ? "r+" : "w");
 		if (!outfp) {
 			perror("output file");
 			exit(1);
 		}
 	}
 
-	int found, inmemory, proc_i, add_here, FIFOsize = 0;
 	// for Second Chance and FIFO
-	struct FIFOentry FIFO[naccess];
-	// process memory trace using replacement strategy
-	for (int ts = 0; ts < naccess; ts++) {
-		// keep track of # access per process
-		proc_i = trace[ts].pid;
-		(p_dir[proc_i].access)++;
-
-		// check if the frame maps to a page & its present bit
-		int inmemory = found = 0;
-		int page_i = 0;
-		while ((found != 1) && (page_i < p_dir[proc_i].page_mapped)) {
-			if (p_dir[proc_i].PT[page_i].frame == trace[ts].addr) {
-				found = 1;
-				if (p_dir[proc_i].PT[page_i].present == 1) {
-					inmemory = 1;
-				}
-			}
-			else {
-				page_i++;
-			}
-		}
-
-		// in main memory
-		if (inmemory == 1) {
-			p_dir[proc_i].PT[page_i].count++;
-			p_dir[proc_i].PT[page_i].refts = ts;
-			p_dir[proc_i].PT[page_i].refer = 1;
-		}
-		// in page table but not in main memory
-		else if (found == 1) {
-			// evict if necessary
-			if (p_dir[proc_i].frame_loaded >= p_dir[proc_i].num_frame) {
-				evictPage(p_dir, FIFO, proc_i, FIFOsize, naccess, evict, replacement);
-			}
-
-			// load the frame into the memory
-			(p_dir[proc_i].frame_loaded)++;
-			(p_dir[proc_i].faults)++;
-			p_dir[proc_i].PT[page_i].present = p_dir[proc_i].PT[page_i].refer = p_dir[proc_i].PT[page_i].count = 1;
-			p_dir[proc_i].PT[page_i].refts = p_dir[proc_i].PT[page_i].addts = ts;
-		}
-		// not in both main memory and page table
-		else {
-			// no eviction, new mapping
-			if (p_dir[proc_i].frame_loaded < p_dir[proc_i].num_frame) {
-				add_here = p_dir[proc_i].page_mapped;
-				// load frame into memory
-				(p_dir[proc_i].frame_loaded)++;
-				p_dir[proc_i].PT[add_here].frame = trace[ts].addr;
-				p_dir[proc_i].PT[add_here].refer = p_dir[proc_i].PT[add_here].count = p_dir[proc_i].PT[add_here].present = 1;
-				p_dir[proc_i].PT[add_here].addts = p_dir[proc_i].PT[add_here].refts = ts;
-				(p_dir[proc_i].page_mapped)++;
-
-				FIFO[FIFOsize].proc_i = proc_i;
-				FIFO[FIFOsize].pte = &(p_dir[proc_i].PT[add_here]);
-				FIFOsize++;
-				(p_dir[proc_i].faults)++;
-			}
-			// yes eviction, new mapping
-			else {
-				evictPage(p_dir, FIFO, proc_i, FIFOsize, naccess, evict, replacement);
-
-				add_here = p_dir[proc_i].page_mapped;
-				// load frame into memory
-				(p_dir[proc_i].frame_loaded)++;
-				p_dir[proc_i].PT[add_here].frame = trace[ts].addr;
-				p_dir[proc_i].PT[add_here].refer = p_dir[proc_i].PT[add_here].count = p_dir[proc_i].PT[add_here].present = 1;
-				p_dir[proc_i].PT[add_here].addts = p_dir[proc_i].PT[add_here].refts = ts;
-				(p_dir[proc_i].page_mapped)++;
+	// every page is appended once, when it is first mapped
+	int FIFOsize = 0;
+	int FIFOmax = (naccess < nproc*MAXPAGES) ? naccess : nproc*MAXPAGES;
+	struct FIFOentry *FIFO = calloc(FIFOmax > 0 ? FIFOmax : 1, sizeof(struct FIFOentry));
+	if (!FIFO) {
+		perror("FIFO alloc");
+		exit(1);
+	}
 
-				FIFO[FIFOsize].proc_i = proc_i;
-				FIFO[FIFOsize].pte = &(p_dir[proc_i].PT[add_here]);
-				FIFOsize++;
-				(p_dir[proc_i].faults)++;
-			}
-		}
+	// everything that identifies this run goes in the checkpoint header
+	struct ckpt_s ckpt;
+	memset(&ckpt, 0, sizeof(ckpt));
+	memcpy(ckpt.magic, "VMCK", 4);
+	ckpt.version = CKPT_VERSION;
+	ckpt.memsize = memsize;
+	ckpt.pagesize = pagesize;
+	ckpt.alloc = alloc;
+	ckpt.evict = evict;
+	ckpt.replacement = replacement;
+	ckpt.period = period;
+	ckpt.rate = rate;
+	ckpt.nproc = nproc;
+	ckpt.count = count;
+	ckpt.naccess = naccess;
 
-		if (period != 0) {
-			// write to ptable.txt every period
-			if (((ts + 1) % period) == 0) {
-				fprintf(outfp, "------------------------------ Time: %d ------------------------------\n", ts);
-				for(int i = 0; i < nproc; i++) {
-					fprintf(outfp, "PROCESS %d: (%d pages, %d frames)\n", i, p_dir[i].num_page, p_dir[i].num_frame);
-					for (int j = 0; j < p_dir[i].num_page; j++) {
-						if (j < p_dir[i].page_mapped) {
-							fprintf(outfp, "page:%-5d ", j);
-							fprintf(outfp, "inframe:%-2d ", p_dir[i].PT[j].present);
-							fprintf(outfp, "addts:%-3d", p_dir[i].PT[j].addts);
-							fprintf(outfp, "refts:%-3d", p_dir[i].PT[j].refts);
-							fprintf(outfp, "refbit:%-2d", p_dir[i].PT[j].refer);
-							fprintf(outfp, "refcount:%-3d", p_dir[i].PT[j].count);
-							fprintf(outfp, "frame address:%-5d", p_dir[i].PT[j].frame);
-							fprintf(outfp, "\n");
-						}
-						else {
-							fprintf(outfp, "page:%-5d ", j);
-							fprintf(outfp, "inframe:%-2d ", 0);
-							fprintf(outfp, "addts:%-3d", 0);
-							fprintf(outfp, "refts:%-3d", 0);
-							fprintf(outfp, "refbit:%-2d", 0);
-							fprintf(outfp, "refcount:%-3d", 0);
-							fprintf(outfp, "frame address:%-5d", 0);
-							fprintf(outfp, "\n");
-						}
-					}
-				}
-			}
-		}
-		// reset refer every 100 memory access
-		if (((ts + 1) % 100) == 0) {
-			for (int i = 0; i < nproc; i++) {
-				for (int j = 0; j < p_dir[i].page_mapped; j++) {
-					p_dir[i].PT[j].refer = 0;
-				}
-			}
+	int start = 0;
+	if (resume) {
+		if (checkpointLoad(&ckpt, p_dir, FIFO) == -1)
+			exit(1);
+		start = ckpt.ts;
+		FIFOsize = ckpt.FIFOsize;
+		// drop snapshots written after the checkpoint
+		if (outfp && ((ftruncate(fileno(outfp), ckpt.ptable_len) == -1) || (fseek(outfp, ckpt.ptable_len, SEEK_SET) == -1))) {
+			perror("ptable truncate");
+			exit(1);
 		}
+	}
 
+	struct sim_s sim;
+	sim.p_dir = p_dir;
+	sim.FIFO = FIFO;
+	sim.FIFOsize = FIFOsize;
+	sim.trace = trace;
+	sim.nproc = nproc;
+	sim.naccess = naccess;
+	sim.period = period;
+	sim.refreset = refreset;
+	sim.outfp = outfp;
+	sim.ckpt_period = ckpt_period;
+	sim.ckpt = &ckpt;
+	sim.ckpt_child = 0;
 
-	}
+	// process memory trace
+	simulate(&sim, start, evict, replacement);
 
 	int total_faults = 0;
 	for (int i = 0; i < nproc; i++) {
 		total_faults += p_dir[i].faults;
 	}
 
+	if (sim.ckpt_child != 0)
+		waitpid(sim.ckpt_child, NULL, 0);
 	if (period != 0)
 		fclose(outfp);
+	free(FIFO);
 	free(trace);
 	printf("*****************************************************\n");
 	printf("memsize   : %13d   pagesize: %12d   period     : %8d  nframes: %d\n",
@@ -378,10 +473,13 @@ int main(int argc, char **argv) {
 			alloc == AllocEq ? "equal" : "proportional",
 			evict == EvictFIFO ? "FIFO"  :
 			(evict == EvictSecond ? "SecondChance" :
-			 (evict == EvictLRU ? "LRU" : "LFU")),
+			 (evict == EvictLRU ? "LRU" :
+			  (evict == EvictLFU ? "LFU" : "EnhancedSecond"))),
 			replacement == ReplacementGlobal ? "global" : "local");
 
 	printf("trace contains %d memory accesses\n", count);
+	if (rate < 1.0)
+		printf("sampling rate: %.4f   simulated %d accesses, counts below are estimates\n", rate, naccess);
 	printf("*****************************************************\n");
 	printf("%d processes -- memory sizes:\n", nproc);
 	for (int i = 0; i < nproc; i++) {
@@ -389,9 +487,41 @@ int main(int argc, char **argv) {
 	}
 	printf("*****************************************************\n");
 	for (int i = 0; i < nproc; i++) {
-		printf("Process %d faults: %d/%d (%.3f%%)\n\n", i, p_dir[i].faults, p_dir[i].access, (100*(double)p_dir[i].faults/(double)p_dir[i].access));
+		// scale sampled counts back up to the full trace
+		printf("Process %d faults: %d/%d (%.3f%%)\n\n", i, (int)(p_dir[i].faults / rate + 0.5), (int)(p_dir[i].access / rate + 0.5),
+				(p_dir[i].access == 0) ? 0.0 : (100*(double)p_dir[i].faults/(double)p_dir[i].access));
+	}
+	printf("Total faults: %d/%d (%.3f%%)\n\n", (int)(total_faults / rate + 0.5), count,
+			(naccess == 0) ? 0.0 : (100*(double)total_faults/(double)naccess));
+
+	// page-out traffic, dirty pages still resident would be written back at exit
+	int total_writebacks = 0, total_resident = 0;
+	printf("*****************************************************\n");
+	for (int i = 0; i < nproc; i++) {
+		int resident = 0;
+		for (int j = 0; j < p_dir[i].page_mapped; j++)
+			resident += p_dir[i].PT[j].present && p_dir[i].PT[j].dirty;
+		printf("Process %d write-backs: %d   dirty resident: %d\n", i, (int)(p_dir[i].writebacks / rate + 0.5), (int)(resident / rate + 0.5));
+		total_writebacks += p_dir[i].writebacks;
+		total_resident += resident;
+	}
+	printf("Total write-backs: %d   dirty resident: %d\n", (int)(total_writebacks / rate + 0.5), (int)(total_resident / rate + 0.5));
+
+	// memory stall time predicted by the cost model
+	cost[LAT_HIT] = hit_cost;
+	cost[LAT_MINOR] = minor_cost;
+	cost[LAT_MAJOR] = major_cost;
+	cost[LAT_MINOR_WB] = minor_cost + wb_cost;
+	cost[LAT_MAJOR_WB] = major_cost + wb_cost;
+	int total_lat[LAT_CLASSES] = {0};
+	printf("*****************************************************\n");
+	printf("cost (ns): hit %ld  minor %ld  major %ld  write-back %ld\n", hit_cost, minor_cost, major_cost, wb_cost);
+	for (int i = 0; i < nproc; i++) {
+		printLatency(i, p_dir[i].lat, cost, rate);
+		for (int c = 0; c < LAT_CLASSES; c++)
+			total_lat[c] += p_dir[i].lat[c];
 	}
-	printf("Total faults: %d/%d (%.3f%%)\n\n", total_faults, naccess, (100*(double)total_faults/(double)naccess));
+	printLatency(-1, total_lat, cost, rate);
 
 	return 0;
 }
@@ -399,7 +529,7 @@ int main(int argc, char **argv) {
 /*
  * evict - evict the best candidate page from those resident in memory
  * @param pid the process requesting eviction
- * @returns 1 if frame stolen from another process, 0 otherwise
+ * @returns 1 if the evicted page was dirty and is written back, 0 otherwise
  *
  */
 int evictPage(struct PCB p_dir[], struct FIFOentry FIFO[], int proc_i, int FIFOsize, int naccess, evict_t e, local_t r) {
@@ -420,11 +550,29 @@ int evictPage(struct PCB p_dir[], struct FIFOentry FIFO[], int proc_i, int FIFOs
 			// call LFU eviction function here
 			return evictLFU(p_dir, FIFO, proc_i, FIFOsize, naccess, r);
 			break;
+		case EvictESC:
+			// call enhanced second chance eviction function here
+			return evictESC(p_dir, FIFO, proc_i, FIFOsize, naccess, r);
+			break;
 	}
 	return -1;
 }
 
+/*
+ * clearPTE - reset the entry of an evicted page, counting its write-back if dirty
+ * @param owner the process the page belongs to
+ * @param pte the evicted page
+ * @returns 1 if the page was dirty, 0 otherwise
+ */
+int clearPTE(struct PCB *owner, struct PTE *pte) {
+	int dirty = pte->dirty;
+	owner->writebacks += dirty;
+	pte->refer = pte->count = pte->present = pte->addts = pte->refts = pte->dirty = 0;
+	return dirty;
+}
+
 int evictFIFO(struct PCB p_dir[], struct FIFOentry FIFO[], int proc_i, int FIFOsize, int naccess, local_t replace) {
+	int dirty;
 	if (replace == ReplacementGlobal) {
 		int candidate = 0, found = 0;
 		while ((found != 1) && (candidate < FIFOsize)) {
@@ -437,11 +585,11 @@ int evictFIFO(struct PCB p_dir[], struct FIFOentry FIFO[], int proc_i, int FIFOs
 		}
 
 		// evict the candidate
-		FIFO[candidate].pte->refer = FIFO[candidate].pte->count = FIFO[candidate].pte->present = FIFO[candidate].pte->addts = FIFO[candidate].pte->refts = 0;
+		dirty = clearPTE(&p_dir[FIFO[candidate].proc_i], FIFO[candidate].pte);
 		(p_dir[FIFO[candidate].proc_i].frame_loaded)--;
 		(p_dir[FIFO[candidate].proc_i].num_frame)--;
 		(p_dir[proc_i].num_frame)++;
-		return 0;
+		return dirty;
 	}
 	// ReplacementLocal
 	else {
@@ -461,13 +609,14 @@ int evictFIFO(struct PCB p_dir[], struct FIFOentry FIFO[], int proc_i, int FIFOs
 
 		}
 		// evict the candidate
-		FIFO[candidate].pte->refer = FIFO[candidate].pte->count = FIFO[candidate].pte->present = FIFO[candidate].pte->addts = FIFO[candidate].pte->refts = 0;
+		dirty = clearPTE(&p_dir[FIFO[candidate].proc_i], FIFO[candidate].pte);
 		(p_dir[proc_i].frame_loaded)--;
-		return 1;
+		return dirty;
 	}
 }
 
 int evictSecond(struct PCB p_dir[], struct FIFOentry FIFO[], int proc_i, int FIFOsize, int naccess, local_t replace) {
+	int dirty;
 	if (replace == ReplacementGlobal) {
 		int candidate = 0, found = 0;
 		while ((found != 1) && (candidate < FIFOsize)) {
@@ -488,16 +637,16 @@ int evictSecond(struct PCB p_dir[], struct FIFOentry FIFO[], int proc_i, int FIF
 
 		if (found == 1) {
 			// evict the candidate
-			FIFO[candidate].pte->refer = FIFO[candidate].pte->count = FIFO[candidate].pte->present = FIFO[candidate].pte->addts = FIFO[candidate].pte->refts = 0;
+			dirty = clearPTE(&p_dir[FIFO[candidate].proc_i], FIFO[candidate].pte);
 			(p_dir[FIFO[candidate].proc_i].frame_loaded)--;
 			(p_dir[FIFO[candidate].proc_i].num_frame)--;
 			(p_dir[proc_i].num_frame)++;
 		}
 		else {
 			// evict according to FIFO
-			evictFIFO(p_dir, FIFO, proc_i, FIFOsize, naccess, replace);
+			dirty = evictFIFO(p_dir, FIFO, proc_i, FIFOsize, naccess, replace);
 		}
-		return 0;
+		return dirty;
 	}
 	// ReplacementLocal
 	else {
@@ -524,19 +673,19 @@ int evictSecond(struct PCB p_dir[], struct FIFOentry FIFO[], int proc_i, int FIF
 
 		if (found == 1) {
 			// evict the candidate
-			FIFO[candidate].pte->refer = FIFO[candidate].pte->count = FIFO[candidate].pte->present = 0;
-			FIFO[candidate].pte->addts = FIFO[candidate].pte->refts = 0;
+			dirty = clearPTE(&p_dir[FIFO[candidate].proc_i], FIFO[candidate].pte);
 			(p_dir[FIFO[candidate].proc_i].frame_loaded)--;
 		}
 		else {
 			// evict according to FIFO
-			evictFIFO(p_dir, FIFO, proc_i, FIFOsize, naccess, replace);
+			dirty = evictFIFO(p_dir, FIFO, proc_i, FIFOsize, naccess, replace);
 		}
 
-		return 1;
+		return dirty;
 	}
 }
 int evictLRU(struct PCB p_dir[], struct FIFOentry FIFO[], int proc_i, int FIFOsize, int naccess, local_t replace) {
+	int dirty;
 	if (replace == ReplacementGlobal) {
 		// find minimum refts in ALL page tables
 		// use FIFO to trace
@@ -549,11 +698,11 @@ int evictLRU(struct PCB p_dir[], struct FIFOentry FIFO[], int proc_i, int FIFOsi
 		}
 
 		// evict candidate
-		FIFO[candidate].pte->refer = FIFO[candidate].pte->count = FIFO[candidate].pte->present = FIFO[candidate].pte->addts = FIFO[candidate].pte->refts = 0;
+		dirty = clearPTE(&p_dir[FIFO[candidate].proc_i], FIFO[candidate].pte);
 		(p_dir[FIFO[candidate].proc_i].frame_loaded)--;
 		(p_dir[FIFO[candidate].proc_i].num_frame)--;
 		(p_dir[proc_i].num_frame)++;
-		return 0;
+		return dirty;
 	}
 	// ReplacementLocal
 	else {
@@ -566,13 +715,14 @@ int evictLRU(struct PCB p_dir[], struct FIFOentry FIFO[], int proc_i, int FIFOsi
 		}
 
 		// evict candidate
-		p_dir[proc_i].PT[candidate].refer = p_dir[proc_i].PT[candidate].count = p_dir[proc_i].PT[candidate].present = p_dir[proc_i].PT[candidate].addts = p_dir[proc_i].PT[candidate].refts = 0;
+		dirty = clearPTE(&p_dir[proc_i], &p_dir[proc_i].PT[candidate]);
 		(p_dir[proc_i].frame_loaded)--;
-		return 1;
+		return dirty;
 	}
 }
 
 int evictLFU(struct PCB p_dir[], struct FIFOentry FIFO[], int proc_i, int FIFOsize, int naccess, local_t replace) {
+	int dirty;
 	if (replace == ReplacementGlobal) {
 		// find minimum count in ALL page tables
 		// use FIFO to trace
@@ -585,12 +735,12 @@ int evictLFU(struct PCB p_dir[], struct FIFOentry FIFO[], int proc_i, int FIFOsi
 		}
 
 		// evict candidate
-		FIFO[candidate].pte->refer = FIFO[candidate].pte->count = FIFO[candidate].pte->present = FIFO[candidate].pte->addts = FIFO[candidate].pte->refts = 0;
+		dirty = clearPTE(&p_dir[FIFO[candidate].proc_i], FIFO[candidate].pte);
 		(p_dir[FIFO[candidate].proc_i].frame_loaded)--;
 		(p_dir[FIFO[candidate].proc_i].num_frame)--;
 		(p_dir[proc_i].num_frame)++;
 
-		return 0;
+		return dirty;
 	}
 	// ReplacementLocal
 	else {
@@ -603,8 +753,417 @@ int evictLFU(struct PCB p_dir[], struct FIFOentry FIFO[], int proc_i, int FIFOsi
 		}
 
 		// evict candidate
-		p_dir[proc_i].PT[candidate].refer = p_dir[proc_i].PT[candidate].count = p_dir[proc_i].PT[candidate].present = p_dir[proc_i].PT[candidate].addts = p_dir[proc_i].PT[candidate].refts = 0;
+		dirty = clearPTE(&p_dir[proc_i], &p_dir[proc_i].PT[candidate]);
 		(p_dir[proc_i].frame_loaded)--;
-		return 1;
+		return dirty;
+	}
+}
+
+/*
+ * evictESC - enhanced second chance, prefers victims by (refbit, dirty) class
+ * 	    - (0, 0) first, then (0, 1), then (1, 0) and (1, 1) once their refbits are cleared
+ * 	    - evicting clean pages first saves write-backs
+ */
+int evictESC(struct PCB p_dir[], struct FIFOentry FIFO[], int proc_i, int FIFOsize, int naccess, local_t replace) {
+	int dirty, candidate = -1;
+
+	// pass 0 and 2 look for (0, 0) without touching anything
+	// pass 1 and 3 look for (0, 1) and clear the refbit of every page passed over
+	for (int pass = 0; (pass < 4) && (candidate == -1); pass++) {
+		for (int i = 0; i < FIFOsize; i++) {
+			// search only in my process table for local replacement
+			if ((replace == ReplacementLocal) && (FIFO[i].proc_i != proc_i))
+				continue;
+			if (FIFO[i].pte->present == 0)
+				continue;
+			if ((FIFO[i].pte->refer == 0) && (FIFO[i].pte->dirty == (pass & 1))) {
+				candidate = i;
+				break;
+			}
+			if (pass & 1)
+				FIFO[i].pte->refer = 0;
+		}
+	}
+
+	if (candidate == -1) {
+		// evict according to FIFO
+		return evictFIFO(p_dir, FIFO, proc_i, FIFOsize, naccess, replace);
+	}
+
+	// evict the candidate
+	dirty = clearPTE(&p_dir[FIFO[candidate].proc_i], FIFO[candidate].pte);
+	(p_dir[FIFO[candidate].proc_i].frame_loaded)--;
+	if (replace == ReplacementGlobal) {
+		(p_dir[FIFO[candidate].proc_i].num_frame)--;
+		(p_dir[proc_i].num_frame)++;
+	}
+	return dirty;
+}
+
+/*
+ * simulate - process the memory trace from start to the end
+ * @param sim simulation state
+ * @param start first trace index to simulate
+ * @param evict eviction algorithm
+ * @param replacement global or local
+ */
+void simulate(struct sim_s *sim, int start, evict_t evict, local_t replacement) {
+	struct PCB *p_dir = sim->p_dir;
+	struct FIFOentry *FIFO = sim->FIFO;
+	access_t *trace = sim->trace;
+	int nproc = sim->nproc, naccess = sim->naccess, period = sim->period;
+	int FIFOsize = sim->FIFOsize;
+	int found, proc_i, add_here, writeback;
+	// accesses left until the next reference bit reset and checkpoint,
+	// counted down instead of taking ts modulo every access
+	int reset_left = sim->refreset - (start % sim->refreset);
+	int ckpt_left = (sim->ckpt_period != 0) ? sim->ckpt_period - (start % sim->ckpt_period) : -1;
+
+	for (int ts = start; ts < naccess; ts++) {
+		// keep track of # access per process
+		proc_i = trace[ts].pid;
+		(p_dir[proc_i].access)++;
+
+		// check if the frame maps to a page & its present bit
+		int inmemory = found = 0;
+		int page_i = 0;
+		while ((found != 1) && (page_i < p_dir[proc_i].page_mapped)) {
+			if (p_dir[proc_i].PT[page_i].frame == trace[ts].addr) {
+				found = 1;
+				if (p_dir[proc_i].PT[page_i].present == 1) {
+					inmemory = 1;
+				}
+			}
+			else {
+				page_i++;
+			}
+		}
+
+		// in main memory
+		if (inmemory == 1) {
+			p_dir[proc_i].PT[page_i].count++;
+			p_dir[proc_i].PT[page_i].refts = ts;
+			p_dir[proc_i].PT[page_i].refer = 1;
+			p_dir[proc_i].PT[page_i].dirty |= trace[ts].write;
+			p_dir[proc_i].lat[LAT_HIT]++;
+		}
+		// in page table but not in main memory
+		// major fault, the page was evicted and is read back
+		else if (found == 1) {
+			// evict if necessary
+			writeback = 0;
+			if (p_dir[proc_i].frame_loaded >= p_dir[proc_i].num_frame) {
+				writeback = evictPage(p_dir, FIFO, proc_i, FIFOsize, naccess, evict, replacement);
+			}
+
+			// load the frame into the memory
+			(p_dir[proc_i].frame_loaded)++;
+			(p_dir[proc_i].faults)++;
+			p_dir[proc_i].PT[page_i].present = p_dir[proc_i].PT[page_i].refer = p_dir[proc_i].PT[page_i].count = 1;
+			p_dir[proc_i].PT[page_i].refts = p_dir[proc_i].PT[page_i].addts = ts;
+			p_dir[proc_i].PT[page_i].dirty = trace[ts].write;
+			p_dir[proc_i].lat[writeback ? LAT_MAJOR_WB : LAT_MAJOR]++;
+		}
+		// not in both main memory and page table
+		// minor fault, first touch of the page needs no read
+		else {
+			// no eviction, new mapping
+			if (p_dir[proc_i].frame_loaded < p_dir[proc_i].num_frame) {
+				add_here = p_dir[proc_i].page_mapped;
+				// load frame into memory
+				(p_dir[proc_i].frame_loaded)++;
+				p_dir[proc_i].PT[add_here].frame = trace[ts].addr;
+				p_dir[proc_i].PT[add_here].refer = p_dir[proc_i].PT[add_here].count = p_dir[proc_i].PT[add_here].present = 1;
+				p_dir[proc_i].PT[add_here].addts = p_dir[proc_i].PT[add_here].refts = ts;
+				p_dir[proc_i].PT[add_here].dirty = trace[ts].write;
+				(p_dir[proc_i].page_mapped)++;
+
+				FIFO[FIFOsize].proc_i = proc_i;
+				FIFO[FIFOsize].pte = &(p_dir[proc_i].PT[add_here]);
+				FIFOsize++;
+				(p_dir[proc_i].faults)++;
+				p_dir[proc_i].lat[LAT_MINOR]++;
+			}
+			// yes eviction, new mapping
+			else {
+				writeback = evictPage(p_dir, FIFO, proc_i, FIFOsize, naccess, evict, replacement);
+
+				add_here = p_dir[proc_i].page_mapped;
+				// load frame into memory
+				(p_dir[proc_i].frame_loaded)++;
+				p_dir[proc_i].PT[add_here].frame = trace[ts].addr;
+				p_dir[proc_i].PT[add_here].refer = p_dir[proc_i].PT[add_here].count = p_dir[proc_i].PT[add_here].present = 1;
+				p_dir[proc_i].PT[add_here].addts = p_dir[proc_i].PT[add_here].refts = ts;
+				p_dir[proc_i].PT[add_here].dirty = trace[ts].write;
+				(p_dir[proc_i].page_mapped)++;
+
+				FIFO[FIFOsize].proc_i = proc_i;
+				FIFO[FIFOsize].pte = &(p_dir[proc_i].PT[add_here]);
+				FIFOsize++;
+				(p_dir[proc_i].faults)++;
+				p_dir[proc_i].lat[writeback ? LAT_MINOR_WB : LAT_MINOR]++;
+			}
+		}
+
+		if (period != 0) {
+			// write to ptable.txt every period
+			if (((ts + 1) % period) == 0)
+				printPTable(sim->outfp, p_dir, nproc, ts);
+		}
+		// reset refer every 100 memory access
+		if (--reset_left == 0) {
+			reset_left = sim->refreset;
+			for (int i = 0; i < nproc; i++) {
+				for (int j = 0; j < p_dir[i].page_mapped; j++) {
+					p_dir[i].PT[j].refer = 0;
+				}
+			}
+		}
+
+		if (--ckpt_left == 0) {
+			ckpt_left = sim->ckpt_period;
+			sim->FIFOsize = FIFOsize;
+			checkpointStart(sim, ts + 1);
+		}
+	}
+
+	sim->FIFOsize = FIFOsize;
+}
+
+/*
+ * printPTable - write a snapshot of every page table to ptable.txt
+ * @param outfp ptable.txt
+ * @param p_dir process directory
+ * @param nproc number of processes
+ * @param ts time of the snapshot
+ */
+void printPTable(FILE *outfp, struct PCB p_dir[], int nproc, int ts) {
+	fprintf(outfp, "------------------------------ Time: %d ------------------------------\n", ts);
+	for(int i = 0; i < nproc; i++) {
+		fprintf(outfp, "PROCESS %d: (%d pages, %d frames)\n", i, p_dir[i].num_page, p_dir[i].num_frame);
+		for (int j = 0; j < p_dir[i].num_page; j++) {
+			if (j < p_dir[i].page_mapped) {
+				fprintf(outfp, "page:%-5d ", j);
+				fprintf(outfp, "inframe:%-2d ", p_dir[i].PT[j].present);
+				fprintf(outfp, "addts:%-3d", p_dir[i].PT[j].addts);
+				fprintf(outfp, "refts:%-3d", p_dir[i].PT[j].refts);
+				fprintf(outfp, "refbit:%-2d", p_dir[i].PT[j].refer);
+				fprintf(outfp, "refcount:%-3d", p_dir[i].PT[j].count);
+				fprintf(outfp, "frame address:%-5d", p_dir[i].PT[j].frame);
+				fprintf(outfp, "dirty:%-2d", p_dir[i].PT[j].dirty);
+				fprintf(outfp, "\n");
+			}
+			else {
+				fprintf(outfp, "page:%-5d ", j);
+				fprintf(outfp, "inframe:%-2d ", 0);
+				fprintf(outfp, "addts:%-3d", 0);
+				fprintf(outfp, "refts:%-3d", 0);
+				fprintf(outfp, "refbit:%-2d", 0);
+				fprintf(outfp, "refcount:%-3d", 0);
+				fprintf(outfp, "frame address:%-5d", 0);
+				fprintf(outfp, "dirty:%-2d", 0);
+				fprintf(outfp, "\n");
+			}
+		}
+	}
+}
+
+/*
+ * checkpointStart - fork a child that writes the checkpoint, copy-on-write keeps the loop running
+ * @param sim simulation state
+ * @param ts next trace index to simulate
+ */
+void checkpointStart(struct sim_s *sim, int ts) {
+	// skip this checkpoint if the previous one is still being written
+	if ((sim->ckpt_child != 0) && (waitpid(sim->ckpt_child, NULL, WNOHANG) == sim->ckpt_child))
+		sim->ckpt_child = 0;
+	if (sim->ckpt_child != 0)
+		return;
+
+	sim->ckpt->ts = ts;
+	sim->ckpt->FIFOsize = sim->FIFOsize;
+	if (sim->outfp) {
+		fflush(sim->outfp);
+		sim->ckpt->ptable_len = ftell(sim->outfp);
+	}
+	sim->ckpt_child = fork();
+	if (sim->ckpt_child == 0) {
+		// _exit() so the parent's stdio buffers are not flushed twice
+		_exit(checkpointSave(sim->ckpt, sim->p_dir, sim->FIFO) == -1 ? 1 : 0);
+	}
+	else if (sim->ckpt_child < 0) {
+		perror("checkpoint fork");
+		sim->ckpt_child = 0;
+	}
+}
+
+/*
+ * printLatency - print the latency histogram, stall time and percentiles of one process
+ * @param proc_i the process, -1 for the whole trace
+ * @param lat accesses per latency class
+ * @param cost cost in ns per latency class
+ * @param rate sampling rate, counts are scaled up by it
+ */
+void printLatency(int proc_i, const int lat[], const long cost[], double rate) {
+	const char *name[LAT_CLASSES] = { "hit", "minor", "major", "minor+wb", "major+wb" };
+	int order[LAT_CLASSES];
+	long accesses = 0;
+	double stall = 0;
+
+	// classes sorted by cost, the percentiles walk them in order
+	for (int c = 0; c < LAT_CLASSES; c++) {
+		int j = c;
+		while ((j > 0) && (cost[order[j - 1]] > cost[c])) {
+			order[j] = order[j - 1];
+			j--;
+		}
+		order[j] = c;
+		accesses += lat[c];
+		stall += (double)lat[c] * cost[c];
+	}
+
+	if (proc_i < 0)
+		printf("Total");
+	else
+		printf("Process %d", proc_i);
+	printf(" stall: %.0f ns  mean: %.1f ns", stall / rate, (accesses == 0) ? 0.0 : stall / accesses);
+
+	const double pct[] = { 0.50, 0.90, 0.99, 0.999 };
+	const char *pname[] = { "p50", "p90", "p99", "p99.9" };
+	for (int k = 0; k < 4; k++) {
+		long seen = 0, at = 0;
+		for (int c = 0; c < LAT_CLASSES; c++) {
+			seen += lat[order[c]];
+			at = cost[order[c]];
+			if (seen >= pct[k] * accesses)
+				break;
+		}
+		printf("  %s: %ld", pname[k], (accesses == 0) ? 0 : at);
+	}
+	printf("\n   ");
+	for (int c = 0; c < LAT_CLASSES; c++)
+		printf(" %s: %d", name[c], (int)(lat[c] / rate + 0.5));
+	printf("\n");
+}
+
+/*
+ * sampleKeep - spatial sampling filter, every access to a page is either kept or dropped
+ * @param pid the process the page belongs to
+ * @param addr the page referenced
+ * @param threshold keep the page if its hash mod SAMPLE_MOD is below this
+ * @returns 1 if the page is sampled, 0 otherwise
+ */
+int sampleKeep(int pid, int addr, unsigned threshold) {
+	// splitmix64 finalizer, spreads nearby pages across the whole range
+	uint64_t h = ((uint64_t)(uint32_t)pid << 32) | (uint32_t)addr;
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebULL;
+	h ^= h >> 31;
+
+	return (unsigned)(h % SAMPLE_MOD) < threshold;
+}
+
+/*
+ * checkpointSave - write the simulator state to CKPT_FILE
+ * @param hdr run configuration and loop position
+ * @param p_dir process directory
+ * @param FIFO fifo queue, hdr->FIFOsize entries
+ * @returns 0 on success, -1 on error
+ */
+int checkpointSave(const struct ckpt_s *hdr, struct PCB p_dir[], struct FIFOentry FIFO[]) {
+	FILE *fp = fopen(CKPT_TMP, "w");
+	if (!fp) {
+		perror("checkpoint fopen");
+		return -1;
+	}
+
+	// everything after PT is counters, only mapped PTEs are worth saving
+	size_t tail = sizeof(struct PCB) - offsetof(struct PCB, proc_size);
+	fwrite(hdr, sizeof(*hdr), 1, fp);
+	for (int i = 0; i < hdr->nproc; i++) {
+		fwrite(&p_dir[i].proc_size, tail, 1, fp);
+		fwrite(p_dir[i].PT, sizeof(struct PTE), p_dir[i].page_mapped, fp);
+	}
+
+	// PTE pointers are stored as page indices
+	for (int i = 0; i < hdr->FIFOsize; i++) {
+		int entry[2];
+		entry[0] = FIFO[i].proc_i;
+		entry[1] = FIFO[i].pte - p_dir[FIFO[i].proc_i].PT;
+		fwrite(entry, sizeof(entry), 1, fp);
+	}
+
+	if (ferror(fp) || (fclose(fp) == EOF)) {
+		perror("checkpoint write");
+		return -1;
+	}
+	if (rename(CKPT_TMP, CKPT_FILE) == -1) {
+		perror("checkpoint rename");
+		return -1;
 	}
+	return 0;
+}
+
+/*
+ * checkpointLoad - restore the simulator state from CKPT_FILE
+ * @param hdr configuration of this run, loop position is filled in on success
+ * @param p_dir process directory to overwrite
+ * @param FIFO fifo queue to overwrite
+ * @returns 0 on success, -1 if missing, corrupt or from a different run
+ */
+int checkpointLoad(struct ckpt_s *hdr, struct PCB p_dir[], struct FIFOentry FIFO[]) {
+	struct ckpt_s saved;
+	FILE *fp = fopen(CKPT_FILE, "r");
+	if (!fp) {
+		perror("checkpoint fopen");
+		return -1;
+	}
+
+	if (fread(&saved, sizeof(saved), 1, fp) != 1) {
+		fprintf(stderr, "checkpoint: truncated header\n");
+		fclose(fp);
+		return -1;
+	}
+
+	// same arguments and same trace, only the loop position may differ
+	struct ckpt_s cmp;
+	memcpy(&cmp, &saved, sizeof(cmp));
+	cmp.ts = hdr->ts;
+	cmp.FIFOsize = hdr->FIFOsize;
+	cmp.ptable_len = hdr->ptable_len;
+	if (memcmp(&cmp, hdr, sizeof(cmp)) != 0) {
+		fprintf(stderr, "checkpoint: written by a different run\n");
+		fclose(fp);
+		return -1;
+	}
+
+	size_t tail = sizeof(struct PCB) - offsetof(struct PCB, proc_size);
+	for (int i = 0; i < saved.nproc; i++) {
+		if ((fread(&p_dir[i].proc_size, tail, 1, fp) != 1) ||
+				(p_dir[i].page_mapped < 0) || (p_dir[i].page_mapped > MAXPAGES) ||
+				(fread(p_dir[i].PT, sizeof(struct PTE), p_dir[i].page_mapped, fp) != (size_t)p_dir[i].page_mapped)) {
+			fprintf(stderr, "checkpoint: truncated process %d\n", i);
+			fclose(fp);
+			return -1;
+		}
+	}
+
+	for (int i = 0; i < saved.FIFOsize; i++) {
+		int entry[2];
+		if ((fread(entry, sizeof(entry), 1, fp) != 1) ||
+				(entry[0] < 0) || (entry[0] >= saved.nproc) ||
+				(entry[1] < 0) || (entry[1] >= p_dir[entry[0]].page_mapped)) {
+			fprintf(stderr, "checkpoint: bad fifo entry %d\n", i);
+			fclose(fp);
+			return -1;
+		}
+		FIFO[i].proc_i = entry[0];
+		FIFO[i].pte = &p_dir[entry[0]].PT[entry[1]];
+	}
+
+	fclose(fp);
+	*hdr = saved;
+	return 0;
 }